@@ -0,0 +1,81 @@
+#include "config.h"
+#include "fs.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Block allocator benchmark on a 4 GiB image.
+
+   Only the block bitmap is built (2 MiB for 4 GiB of 256-byte blocks),
+   the data region is never touched. The bitmap is filled up, a few
+   random blocks are freed, then every round allocates one block and
+   frees another random one, so the disk stays nearly full.
+
+   The same rounds run against the summary levels and against the flat
+   word scan (nr_of_levels forced to 1). */
+
+#define BENCH_DISK_SIZE_IN_B	(4ULL << 30)
+#define BENCH_NR_OF_BLOCKS		(BENCH_DISK_SIZE_IN_B / BLOCK_SIZE_IN_B)
+#define BENCH_NR_OF_FREE		16
+#define BENCH_ROUNDS			20000
+
+static double now () {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench (char *name, int flat) {
+	bitmap_ops_t op;
+	unsigned int i, block;
+	int nr_of_levels;
+	size_t size = BENCH_NR_OF_BLOCKS / 8;
+	void *bitmap = malloc (size);
+
+	if (bitmap == NULL || bitmap_init (&op, bitmap, bitmap + size, BENCH_NR_OF_BLOCKS) < 0) {
+		fprintf (stderr, "bench: out of memory\n");
+		exit (1);
+	}
+	nr_of_levels = op.nr_of_levels;
+	if (flat)
+		op.nr_of_levels = 1;
+
+	// fill the disk, then punch a few holes
+	for (i = 0; i < BENCH_NR_OF_BLOCKS; i++)
+		op.set (&op, i);
+
+	srand (552);
+	for (i = 0; i < BENCH_NR_OF_FREE; i++)
+		op.clear (&op, rand () % BENCH_NR_OF_BLOCKS);
+
+	double start = now ();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		block = op.first_free (&op);
+		if (block == (unsigned int)-1) {
+			fprintf (stderr, "bench: %s: disk full\n", name);
+			exit (1);
+		}
+		op.set (&op, block);
+		op.clear (&op, ((unsigned int)rand () * RAND_MAX + rand ()) % BENCH_NR_OF_BLOCKS);
+	}
+	double elapsed = now () - start;
+
+	printf ("%-8s %d level(s): %8.1f ns per allocation\n", name, op.nr_of_levels, elapsed / BENCH_ROUNDS * 1e9);
+
+	op.nr_of_levels = nr_of_levels;
+	bitmap_destroy (&op);
+	free (bitmap);
+	return elapsed;
+}
+
+int main () {
+	printf ("%llu blocks of %d bytes, %d free\n", BENCH_NR_OF_BLOCKS, BLOCK_SIZE_IN_B, BENCH_NR_OF_FREE);
+
+	double flat = bench ("flat", 1);
+	double summary = bench ("summary", 0);
+
+	printf ("speedup: %.1fx\n", flat / summary);
+	return 0;
+}
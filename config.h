@@ -3,40 +3,80 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H
 
+// defaults, a geometry passed to init_fs overrides them
 #define BLOCK_SIZE_IN_B 	256
+#define BLOCK_SIZE_PAGE		0		// as a geometry block size: one host page per block
 #define INODE_SIZE_IN_B		64
 #define DISK_SIZE_IN_KB 	2048
+#define DEVICE_CHUNK_SIZE_IN_KB	2048	// the free blocks are allocated this much at a time, a huge page
+#define DEVICE_RELEASE_THRESHOLD_IN_KB	4096	// freed since the last pass before memory goes back to the host
+#define NR_OF_INODES		1024
+
+#define MIN_BLOCK_SIZE_IN_B	64
+#define MAX_BLOCK_SIZE_IN_B	65536
+#define MAX_NR_OF_INODES	65536
 
 #define LOC_NR_OF_DIRECT			8
 #define LOC_NR_OF_SINGLE_INDIRECT	1
 #define LOC_NR_OF_DOUBLE_INDIRECT	1
-#define LOC_POINTER_PER_BLOCK		(BLOCK_SIZE_IN_B / sizeof (void *))
-#define LOC_LIMIT_DIRECT			(LOC_NR_OF_DIRECT * BLOCK_SIZE_IN_B)
-#define LOC_LIMIT_SINGLE_INDIRECT 	(LOC_LIMIT_DIRECT + LOC_NR_OF_SINGLE_INDIRECT * LOC_POINTER_PER_BLOCK * BLOCK_SIZE_IN_B)
-#define LOC_LIMIT_DOUBLE_INDIRECT	(LOC_LIMIT_SINGLE_INDIRECT + LOC_NR_OF_DOUBLE_INDIRECT * LOC_POINTER_PER_BLOCK * LOC_POINTER_PER_BLOCK * BLOCK_SIZE_IN_B)
-#define LOC_SIZE_1_LEVEL			BLOCK_SIZE_IN_B
-#define LOC_SIZE_2_LEVEL			(BLOCK_SIZE_IN_B * LOC_POINTER_PER_BLOCK)
-#define LOC_SIZE_3_LEVEL			(BLOCK_SIZE_IN_B * LOC_POINTER_PER_BLOCK * LOC_POINTER_PER_BLOCK)
+#define LOC_NR_OF_TRIPLE_INDIRECT	1
+#define LOC_NO_BLOCK				0	// free block 0 is reserved, it marks an empty slot
 
+// the rest of the layout is computed by geometry_compute
 #define OFFSET_SUPER_BLOCK	0
-#define OFFSET_INODE_ARRAY	1
-#define OFFSET_BLOCK_BITMAP	257
-#define OFFSET_FREE_BLOCK	261
-#define OFFSET_LIMIT		DISK_SIZE_IN_KB * 1024 / BLOCK_SIZE_IN_B
+
+#define BITMAP_BITS_PER_WORD	64
+#define BITMAP_MAX_LEVELS		5
 
 
 #define INODE_TYPE_SIZE				4
 #define INODE_TYPE_DIR				"dir"
 #define INODE_TYPE_REG				"reg"
-#define INODE_ARRAY_SIZE_IN_BLOCK	(OFFSET_BLOCK_BITMAP - OFFSET_INODE_ARRAY)
-#define INODE_ARRAY_SIZE 			(BLOCK_SIZE_IN_B * INODE_ARRAY_SIZE_IN_BLOCK / INODE_SIZE_IN_B)
-#define INODE_ARRAY_INDEX_LIMIT		(INODE_ARRAY_SIZE - 1)
 #define INODE_ROOT_INDEX			0
 
-#define MAX_NR_OF_FILES		INODE_ARRAY_SIZE
+// the type string as a number, for the hot inode array
+#define INODE_KIND_NONE				0
+#define INODE_KIND_DIR				1
+#define INODE_KIND_REG				2
+
+#define INODE_FLAG_EXTENTS			0x01	// blocks mapped by an extent tree instead of location_t
+#define INODE_FLAG_INLINE			0x02	// data kept in the inode, no blocks
+#define INODE_INLINE_DATA_SIZE		48		// what a 64-byte inode has left after its header
+
 #define MAX_FILE_COMPONENT	13
 #define MAX_FILE_FULL		256
-#define MAX_FILE_SIZE		LOC_LIMIT_DOUBLE_INDIRECT
+
+#define INODE_EXPAND_BATCH	64
+#define READDIR_MAX_ENTRIES	1024	// a batched readdir copies out at most this many per call, 4 pages of dentries
+
+// map the blocks of regular files with extents
+#define FS_EXTENT_MAPPING
+#define EXTENT_NR_OF_INLINE	3
+#define EXTENT_MAX_DEPTH	4
+
+// keep the data of small files in the inode until it outgrows it
+#define FS_INLINE_DATA
+
+// remember what recent paths resolved to, misses included
+#define FS_DENTRY_CACHE
+#define DENTRY_CACHE_SIZE	512		// slots, a power of two
+
+#define FS_NR_OF_CPUS			8
+#define BLOCK_MAGAZINE_SIZE		32
+#define BLOCK_MAGAZINE_BATCH	16
+
+// back the device with huge pages where the host has them, host pages otherwise
+#define FS_HUGE_PAGES
+#define HUGE_PAGE_SIZE_IN_KB	2048
+
+// erase blocks when they are freed
+// #define FS_SECURE_ERASE
+
+// free the blocks of large unlinked files in the background
+#define FS_DEFERRED_RECLAIM
+#define RECLAIM_ASYNC_THRESHOLD_IN_KB		1024	// smaller files are freed right away
+#define RECLAIM_QUEUE_SIZE					16
+#define RECLAIM_BATCH						64
 
 #define PATH_DELIMITER_CHAR	'/'
 
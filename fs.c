@@ -3,12 +3,16 @@
 #ifndef _KERNEL_MODE
 	// #include <assert.h>
 	#include <unistd.h>
+	#include <stdlib.h>
+	#include <sys/mman.h>
 	#include <malloc.h>
 	#include <string.h>
 	#include <stdio.h>
 #else
 	#include <linux/string.h>
 	#include <linux/vmalloc.h>
+	#include <linux/gfp.h>
+	#include <linux/mm.h>
 	#include <linux/module.h>         /* Needed for the macros */
 	MODULE_LICENSE("GPL");
 
@@ -19,22 +23,91 @@
 
 
 
-fs_t* init_fs () {
+// the default geometry from config.h
+void geometry_default (geometry_t *geometry) {
+	memset (geometry, 0, sizeof (geometry_t));
+	geometry->disk_size_in_kb = DISK_SIZE_IN_KB;
+	geometry->block_size = BLOCK_SIZE_IN_B;
+	geometry->nr_of_inodes = NR_OF_INODES;
+}
+
+// derive the disk layout from disk size, block size and inode count
+int geometry_compute (geometry_t *geometry) {
+	unsigned long long nr_of_blocks, bitmap_size;
+	unsigned int block_size;
+
+	// blocks and pages line up, whole pages per copy
+	if (geometry->block_size == BLOCK_SIZE_PAGE)
+		geometry->block_size = fs_page_size ();
+	block_size = geometry->block_size;
+
+	// a power of two, holding whole dentries and index entries
+	if (block_size < MIN_BLOCK_SIZE_IN_B || block_size > MAX_BLOCK_SIZE_IN_B || (block_size & (block_size - 1)) != 0)
+		return -1;
+	if (geometry->nr_of_inodes <= INODE_ROOT_INDEX + 1 || geometry->nr_of_inodes > MAX_NR_OF_INODES)
+		return -1;
+
+	// block numbers are ints
+	nr_of_blocks = (unsigned long long)geometry->disk_size_in_kb * 1024 / block_size;
+	if (nr_of_blocks > 0x7fffffff)
+		return -1;
+
+	// super block, inode array, block bitmap, then the free blocks
+	geometry->offset_inode_array = OFFSET_SUPER_BLOCK + (sizeof (super_block_t) + block_size - 1) / block_size;
+	geometry->offset_block_bitmap = geometry->offset_inode_array + ((unsigned long long)geometry->nr_of_inodes * sizeof (index_node_t) + block_size - 1) / block_size;
+	if (geometry->offset_block_bitmap >= nr_of_blocks)
+		return -1;
+
+	// one bit for every block past the bitmap, in whole words
+	bitmap_size = (nr_of_blocks - geometry->offset_block_bitmap + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD * sizeof (bitmap_word_t);
+	geometry->offset_free_block = geometry->offset_block_bitmap + (bitmap_size + block_size - 1) / block_size;
+	geometry->offset_limit = nr_of_blocks;
+	if (geometry->offset_free_block >= geometry->offset_limit)
+		return -1;
+
+	// location object limits
+	geometry->pointer_per_block = block_size / sizeof (block_number_t);
+	geometry->extents_per_block = (block_size - sizeof (extent_header_t)) / sizeof (extent_t);
+	geometry->size_1_level = block_size;
+	geometry->size_2_level = geometry->size_1_level * geometry->pointer_per_block;
+	geometry->size_3_level = geometry->size_2_level * geometry->pointer_per_block;
+	geometry->size_4_level = geometry->size_3_level * geometry->pointer_per_block;
+	geometry->limit_direct = LOC_NR_OF_DIRECT * geometry->size_1_level;
+	geometry->limit_single_indirect = geometry->limit_direct + LOC_NR_OF_SINGLE_INDIRECT * geometry->size_2_level;
+	geometry->limit_double_indirect = geometry->limit_single_indirect + LOC_NR_OF_DOUBLE_INDIRECT * geometry->size_3_level;
+	geometry->limit_triple_indirect = geometry->limit_double_indirect + LOC_NR_OF_TRIPLE_INDIRECT * geometry->size_4_level;
+	geometry->max_file_size = geometry->limit_triple_indirect;
+
+	// extents count logical blocks in 32 bits
+	geometry->max_extent_file_size = 0xffffffffLL * block_size;
+
+	return 0;
+}
+
+// build a file system with the given geometry, or the default one when NULL
+fs_t* init_fs (geometry_t *geometry) {
+	geometry_t layout;
+
+	if (geometry == NULL)
+		geometry_default (&layout);
+	else
+		layout = *geometry;
+
+	if (geometry_compute (&layout) < 0)
+		return NULL;
+
 	fs_t *fs = (fs_t *)malloc(sizeof(fs_t));
-	// assert (fs != NULL);
+	if (fs == NULL)
+		return NULL;
 
 	memset (fs, 0, sizeof(fs_t));
 
+	// only the metadata is allocated now, the free blocks come in chunks as they are used
 	device_t *device = &fs->device;
-
-	// allocate device
-	device->start = malloc (DISK_SIZE_IN_KB * 1024);
-	// assert (device->start != NULL);
-	device->limit = device->start + DISK_SIZE_IN_KB * 1024;
-	memset (device->start, 0, DISK_SIZE_IN_KB * 1024);
-
-	// setup device
-	device->locate = device_locate;
+	if (device_init (device, &layout) < 0) {
+		free (fs);
+		return NULL;
+	}
 
 	// allocate super block;
 	fs->super_block = device->locate (device, OFFSET_SUPER_BLOCK);
@@ -43,36 +116,74 @@ fs_t* init_fs () {
 
 	// setup super block
 	sb->fs = fs;
+	sb->geometry = layout;
 
-	sb->inodes = device->locate (device, OFFSET_INODE_ARRAY);
-	sb->bitmap = device->locate (device, OFFSET_BLOCK_BITMAP);
-	sb->blocks = device->locate (device, OFFSET_FREE_BLOCK);
+	sb->inodes = device->locate (device, layout.offset_inode_array);
+	sb->bitmap = device->locate (device, layout.offset_block_bitmap);
 	
-	sb->inode_ops.start = device->locate (device, OFFSET_INODE_ARRAY);
-	sb->inode_ops.limit = device->locate (device, OFFSET_BLOCK_BITMAP);
+	sb->inode_ops.start = device->locate (device, layout.offset_inode_array);
+	sb->inode_ops.limit = device->locate (device, layout.offset_block_bitmap);
 	sb->inode_ops.allocate = NULL;
 	sb->inode_ops.free = NULL;
 
-	sb->bitmap_ops.start = device->locate (device, OFFSET_BLOCK_BITMAP);
-	sb->bitmap_ops.limit = device->locate (device, OFFSET_FREE_BLOCK);
-	sb->bitmap_ops.test = bitmap_test;
-	sb->bitmap_ops.set = bitmap_set_;
-	sb->bitmap_ops.clear = bitmap_clear_;
-	sb->bitmap_ops.clear_all = bitmap_clear_all;
-	sb->bitmap_ops.first_free = bitmap_first_free;
-	sb->bitmap_ops.clear_all (&sb->bitmap_ops);
+	// in-memory state: bitmap summaries, free inode stack, per-cpu magazines and the reclaimer
+	sb->free_inode_stack = malloc (layout.nr_of_inodes * sizeof (unsigned short));
+	sb->inode_hot = malloc (layout.nr_of_inodes * sizeof (inode_hot_t));
+	sb->allocator = malloc (sizeof (block_allocator_t));
+	sb->reclaimer = malloc (sizeof (reclaimer_t));
+	memset (&sb->dentry_cache, 0, sizeof (dentry_cache_t));
+#ifdef FS_DENTRY_CACHE
+	sb->dentry_cache.entries = malloc (DENTRY_CACHE_SIZE * sizeof (dentry_cache_entry_t));
+	if (sb->dentry_cache.entries == NULL) {
+		destroy_fs (fs);
+		return NULL;
+	}
+	memset (sb->dentry_cache.entries, 0, DENTRY_CACHE_SIZE * sizeof (dentry_cache_entry_t));
+#endif
+	if (sb->free_inode_stack == NULL || sb->inode_hot == NULL || sb->allocator == NULL || sb->reclaimer == NULL || dir_index_init (sb) < 0) {
+		destroy_fs (fs);
+		return NULL;
+	}
+	fs_reclaim_init (fs);
+
+	int status = bitmap_init (&sb->bitmap_ops,
+		device->locate (device, layout.offset_block_bitmap),
+		device->limit,
+		layout.offset_limit - layout.offset_free_block);
+	if (status < 0) {
+		destroy_fs (fs);
+		return NULL;
+	}
 
-	sb->free_inodes = INODE_ARRAY_SIZE;
-	sb->free_blocks = OFFSET_LIMIT - OFFSET_FREE_BLOCK;
+	// inode 1 on top of the stack
+	int i;
+	sb->free_inodes = 0;
+	for (i = layout.nr_of_inodes - 1; i > INODE_ROOT_INDEX; i--)
+		sb->free_inode_stack[sb->free_inodes++] = i;
+	memset (sb->inode_hot, 0, layout.nr_of_inodes * sizeof (inode_hot_t));
+
+	// the free block counter starts out on cpu 0
+	memset (sb->allocator, 0, sizeof (block_allocator_t));
+	fs_lock_init (&sb->allocator->lock);
+	for (i = 0; i < FS_NR_OF_CPUS; i++)
+		fs_lock_init (&sb->allocator->magazines[i].lock);
+	sb->allocator->magazines[0].free_blocks = layout.offset_limit - layout.offset_free_block;
+
+	// block 0 stands for no block in location objects and index blocks
+	sb->bitmap_ops.set (&sb->bitmap_ops, LOC_NO_BLOCK);
+	sb->allocator->magazines[0].free_blocks--;
 
 	sb->lookup = NULL;
 
 	// setup root inode
 	index_node_t *root = &sb->inodes[INODE_ROOT_INDEX];
 	root->in_use = 1;
-	sb->free_inodes--;
-	strcpy (root->type, INODE_TYPE_DIR);
-	root->size = 0;
+	sb->inode_hot[INODE_ROOT_INDEX].in_use = 1;
+	inode_set_type (sb, INODE_ROOT_INDEX, INODE_TYPE_DIR);
+	inode_set_size (sb, INODE_ROOT_INDEX, 0);
+#ifdef FS_INLINE_DATA
+	root->flags = INODE_FLAG_INLINE;
+#endif
 
 	return fs;
 }
@@ -80,105 +191,272 @@ fs_t* init_fs () {
 int destroy_fs (fs_t *fs) {
 	// assert (fs != NULL);
 
-	free (fs->device.start);
+	fs_reclaim_destroy (fs);
+	free (fs->super_block->reclaimer);
+	free (fs->super_block->allocator);
+	free (fs->super_block->free_inode_stack);
+	free (fs->super_block->inode_hot);
+	dir_index_destroy (fs->super_block);
+	free (fs->super_block->dentry_cache.entries);
+	bitmap_destroy (&fs->super_block->bitmap_ops);
+	device_destroy (&fs->device);
 	free (fs);
 
 	return 0;
 }
 
-unsigned int bitmap_first_free (struct bitmap_ops_t *op) {
-	int i;
-	for (i = 0; i < OFFSET_LIMIT - OFFSET_FREE_BLOCK; i++) {
-		if (op->test (op, i) == 0)
-			return i;
+int bitmap_init (struct bitmap_ops_t *op, void *start, void *limit, unsigned int nr_of_bits) {
+	// assert (nr_of_bits <= (limit - start) * 8);
+
+	int level, total = 0;
+
+	op->start = start;
+	op->limit = limit;
+	op->nr_of_bits = nr_of_bits;
+	op->cursor = 0;
+
+	op->test = bitmap_test;
+	op->set = bitmap_set_;
+	op->clear = bitmap_clear_;
+	op->clear_all = bitmap_clear_all;
+	op->first_free = bitmap_first_free;
+
+	// one summary level per 64x reduction, until a single word covers everything
+	op->nr_of_words[0] = (nr_of_bits + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD;
+	op->nr_of_levels = 1;
+	while (op->nr_of_levels < BITMAP_MAX_LEVELS && op->nr_of_words[op->nr_of_levels - 1] > 1) {
+		level = op->nr_of_levels++;
+		op->nr_of_words[level] = (op->nr_of_words[level - 1] + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD;
+		total += op->nr_of_words[level];
 	}
-	return -1;
+
+	// summaries are in memory only, rebuilt by clear_all
+	op->levels[0] = (bitmap_word_t *)start;
+	if (op->nr_of_levels > 1) {
+		op->levels[1] = malloc (total * sizeof (bitmap_word_t));
+		if (op->levels[1] == NULL)
+			return -1;
+	}
+	for (level = 2; level < op->nr_of_levels; level++)
+		op->levels[level] = op->levels[level - 1] + op->nr_of_words[level - 1];
+
+	return op->clear_all (op);
+}
+
+void bitmap_destroy (struct bitmap_ops_t *op) {
+	if (op->nr_of_levels > 1)
+		free (op->levels[1]);
+	op->nr_of_levels = 0;
+}
+
+// mark a bit used, and propagate upwards every word that becomes full
+static void bitmap_level_set (struct bitmap_ops_t *op, int level, unsigned int bit) {
+	bitmap_word_t *p;
+
+	for (; level < op->nr_of_levels; level++) {
+		p = op->levels[level] + bit / BITMAP_BITS_PER_WORD;
+		*p |= 1ULL << (bit % BITMAP_BITS_PER_WORD);
+
+		if (*p != ~0ULL)
+			return;
+
+		bit /= BITMAP_BITS_PER_WORD;
+	}
+}
+
+// mark a bit free, and propagate upwards every word that stops being full
+static void bitmap_level_clear (struct bitmap_ops_t *op, int level, unsigned int bit) {
+	bitmap_word_t *p;
+	int was_full;
+
+	for (; level < op->nr_of_levels; level++) {
+		p = op->levels[level] + bit / BITMAP_BITS_PER_WORD;
+		was_full = *p == ~0ULL;
+		*p &= ~(1ULL << (bit % BITMAP_BITS_PER_WORD));
+
+		if (!was_full)
+			return;
+
+		bit /= BITMAP_BITS_PER_WORD;
+	}
+}
+
+// first free bit at or after from, one word per level
+static long bitmap_level_next_free (struct bitmap_ops_t *op, int level, unsigned int from) {
+	unsigned int word = from / BITMAP_BITS_PER_WORD;
+	bitmap_word_t free;
+	long next;
+
+	if (word >= op->nr_of_words[level])
+		return -1;
+
+	free = ~op->levels[level][word] & (~0ULL << (from % BITMAP_BITS_PER_WORD));
+
+	if (free == 0) {
+		// ask the level above for the next word that is not full
+		if (level + 1 < op->nr_of_levels) {
+			next = bitmap_level_next_free (op, level + 1, word + 1);
+			if (next < 0)
+				return -1;
+			word = next;
+		}
+		// top level, only a few words
+		else {
+			do {
+				if (++word >= op->nr_of_words[level])
+					return -1;
+			} while (op->levels[level][word] == ~0ULL);
+		}
+
+		free = ~op->levels[level][word];
+	}
+
+	return (long)word * BITMAP_BITS_PER_WORD + __builtin_ctzll (free);
+}
+
+// next-fit search starting from the cursor, wrapping around once
+unsigned int bitmap_first_free (struct bitmap_ops_t *op) {
+	long found = bitmap_level_next_free (op, 0, op->cursor);
+
+	if (found < 0)
+		found = bitmap_level_next_free (op, 0, 0);
+	if (found < 0)
+		return -1;
+
+	op->cursor = found;
+	return found;
 } 
 
 unsigned int bitmap_test (struct bitmap_ops_t *op, int free_block_number ) {
-	// assert (free_block_number >= 0 && free_block_number + OFFSET_FREE_BLOCK < OFFSET_LIMIT);
-
-	char *p = (char *)op->start;
-	char data;
-	int bits = sizeof (char) * 8;
+	// assert (free_block_number >= 0 && free_block_number < op->nr_of_bits);
 
-	p += free_block_number / bits;
-	data = *p;
+	bitmap_word_t *p = op->levels[0] + free_block_number / BITMAP_BITS_PER_WORD;
 
-	return (data >> (free_block_number % bits)) & 1;
+	return (*p >> (free_block_number % BITMAP_BITS_PER_WORD)) & 1;
 }
 
 unsigned int bitmap_set_ (struct bitmap_ops_t *op, int free_block_number) {
-	// assert (free_block_number >= 0 && free_block_number + OFFSET_FREE_BLOCK < OFFSET_LIMIT);
+	// assert (free_block_number >= 0 && free_block_number < op->nr_of_bits);
 
-	char *p = (char *)op->start;
-	char data;
-	int bits = sizeof (char) * 8;
-	p += free_block_number / bits;
-	data = *p;
+	int old = op->test (op, free_block_number);
 
-	int old = (data >> (free_block_number % bits)) & 1;	
-
-	*p |= 1 << (free_block_number % bits);
+	if (!old)
+		bitmap_level_set (op, 0, free_block_number);
 
 	return old;
 }
 
 
 unsigned int bitmap_clear_ (struct bitmap_ops_t *op, int free_block_number) {
-	// assert (free_block_number >= 0 && free_block_number + OFFSET_FREE_BLOCK < OFFSET_LIMIT);
-
-	char *p = (char *)op->start;
-	char data;
-	int bits = sizeof (char) * 8;
-	p += free_block_number / bits;
-	data = *p;
+	// assert (free_block_number >= 0 && free_block_number < op->nr_of_bits);
 
-	int old = (data >> (free_block_number % bits)) & 1;	
+	int old = op->test (op, free_block_number);
 
-	*p &= ~(1 << (free_block_number % bits));
+	if (old)
+		bitmap_level_clear (op, 0, free_block_number);
 	
 	return old;
 
 } 
+
 unsigned int bitmap_clear_all (struct bitmap_ops_t *op) {
+	int level;
+	unsigned int i, nr_of_bits = op->nr_of_bits;
+
 	memset (op->start, 0, op->limit - op->start);
+	op->cursor = 0;
+
+	for (level = 1; level < op->nr_of_levels; level++)
+		memset (op->levels[level], 0, op->nr_of_words[level] * sizeof (bitmap_word_t));
+
+	// the tail of the last word at each level has nothing behind it, keep it used
+	for (level = 0; level < op->nr_of_levels; level++) {
+		for (i = nr_of_bits; i < op->nr_of_words[level] * BITMAP_BITS_PER_WORD; i++)
+			bitmap_level_set (op, level, i);
+		nr_of_bits = op->nr_of_words[level];
+	}
+
 	return 0;
 }
 
 
-int inode_create (super_block_t *sb, char *pathname, char *type) {
+// a new child named name in the parent dir
+int inode_create (super_block_t *sb, int parent, char *name, char *type) {
 	// assert (sb != NULL);
-	// assert (pathname != NULL);
+	// assert (name != NULL);
 
 	// assert (sb->free_inodes > 0);
 
 	// assume parent exists, and child not exists.
-	int parent = inode_lookup_parent (sb, pathname);
-	// assert (parent >= 0);
-	int child = inode_lookup_full (sb, pathname);
-	// assert (child < 0);
-
-	// parent dir dentry
-	dir_entry_t dentry;
-	memset (&dentry, 0, sizeof (dentry));
+	// assert (inode_isdir (sb, parent));
+	// assert (inode_lookup (sb, parent, name) < 0);
 
 	// chlid dir/reg inode
 	int inode = inode_allocate (sb);
 	// assert (inode > 0);
- 	strcpy (sb->inodes[inode].type, type);
- 	sb->inodes[inode].in_use = 1;
+ 	inode_set_type (sb, inode, type);
+
+#ifdef FS_EXTENT_MAPPING
+ 	// regular files map their blocks with extents
+ 	if (inode_isreg (sb, inode))
+ 		sb->inodes[inode].flags |= INODE_FLAG_EXTENTS;
+#endif
+#ifdef FS_INLINE_DATA
+ 	// no blocks until the data outgrows the inode
+ 	sb->inodes[inode].flags |= INODE_FLAG_INLINE;
+#endif
+
+ 	int status = inode_link (sb, parent, name, inode);
+
+ 	return status;
+}
 
- 	// get dirname
- 	char buffer[MAX_FILE_SIZE];
-	int count = path_explode (pathname, buffer);
-	char *p = path_get_component (buffer, count - 1);
+// a dentry for child named name in the parent dir
+int inode_link (super_block_t *sb, int parent, char *name, int child) {
+	// assert (sb != NULL);
+	// assert (inode_lookup (sb, parent, name) < 0);
+
+	// parent dir dentry
+	dir_entry_t dentry;
+	memset (&dentry, 0, sizeof (dentry));
+ 	dentry.inode = child;
+ 	strcpy (dentry.filename, name);
+
+ 	unsigned int position;
+ 	int status = inode_put_dentry (sb, parent, &dentry, &position);
+ 	if (status == sizeof (dentry)) {
+ 		dir_index_insert (sb, parent, name, child, position);
+ 		sb->dir_index.nodes[parent].nr_of_entries++;
+ 	}
 
- 	dentry.inode = inode;
- 	strcpy (dentry.filename, p);
+ 	return status;
+}
 
- 	// write to parent
- 	int status = fs_append (sb->fs, parent, &dentry, sizeof (dentry));
+// dentry written to the parent dir, over its first tombstone if it has one,
+// and the slot it went to. not indexed or counted yet, nothing changes if
+// there is no room for it
+int inode_put_dentry (super_block_t *sb, int parent, dir_entry_t *dentry, unsigned int *position) {
+	// assert (sb != NULL);
+	// assert (inode_isdir (sb, parent));
+
+ 	// a list that does not lead to tombstones is dropped, appending is always right
+ 	dir_index_node_t *dir = &sb->dir_index.nodes[parent];
+ 	long long slots = sb->inodes[parent].size / sizeof (dir_entry_t);
+ 	int status;
+ 	dir_tombstone_t tombstone;
+ 	if (dir->free_slot >= slots || (dir->free_slot >= 0 &&
+ 			(fs_read (sb->fs, parent, dir->free_slot * sizeof (dir_entry_t), &tombstone, sizeof (tombstone)) != sizeof (tombstone)
+ 			|| tombstone.inode != INODE_ROOT_INDEX)))
+ 		dir->free_slot = -1;
+ 	if (dir->free_slot >= 0) {
+ 		*position = dir->free_slot;
+ 		status = fs_write (sb->fs, parent, *position * sizeof (dir_entry_t), dentry, sizeof (dir_entry_t));
+ 		if (status == sizeof (dir_entry_t))
+ 			dir->free_slot = tombstone.next >= -1 && tombstone.next < slots ? tombstone.next : -1;
+ 	} else {
+ 		*position = slots;
+ 		status = fs_append (sb->fs, parent, dentry, sizeof (dir_entry_t));
+ 	}
 
  	return status;
 }
@@ -192,22 +470,22 @@ int fs_mk (fs_t *fs, char *pathname, char *type) {
 	// can't make
 	if (sb->free_inodes == 0)
 		return -1;
-	if (sb->free_blocks == 0)
+	if (fs_count_free_blocks (fs) == 0)
 		return -1;
 	if (strlen (pathname) > MAX_FILE_FULL)
 		return -1;
 
-	// parent not exists
-	int parent = inode_lookup_parent (fs->super_block, pathname);
-	if (parent < 0)
+	// parent not exists, or no name to give
+	int parent, child;
+	char name[MAX_FILE_COMPONENT];
+	if (inode_resolve (sb, pathname, &parent, &child, name) < 0)
 		return -1;
 
 	// child already exists
-	int child = inode_lookup_full (fs->super_block, pathname);
 	if (child >= 0)
 		return -1;
 
-	int status = inode_create (fs->super_block, pathname, type);
+	int status = inode_create (sb, parent, name, type);
 
 	if (status < 0)
 		return -1;
@@ -220,13 +498,13 @@ int fs_rm (fs_t *fs, char *pathname) {
 	// assert (pathname != NULL);
 
 	// parent not exists
-	int parent = inode_lookup_parent (fs->super_block, pathname);
-	if (parent < 0)
+	int parent, child;
+	char name[MAX_FILE_COMPONENT];
+	if (inode_resolve (fs->super_block, pathname, &parent, &child, name) < 0)
 		return -1;
 
-	// child not exists
-	int child = inode_lookup_full (fs->super_block, pathname);
-	if (child < 0)
+	// child not exists, or is the root
+	if (child < 0 || child == INODE_ROOT_INDEX)
 		return -1;
 
 	// child is non-empty dir
@@ -234,49 +512,166 @@ int fs_rm (fs_t *fs, char *pathname) {
 		return -1;
 
 	// child is empty-dir or child is reg file
-	return inode_rm (fs->super_block, pathname);
+	int status = inode_rm (fs->super_block, parent, child, name);
+
+	// a big file gone, give its memory back
+	fs_release_memory_check (fs);
+
+	return status;
 }
 
-int inode_rm (super_block_t *sb, char *pathname) {
-	// assert (sb != NULL);
-	// assert (pathname != NULL);
+// the dentry of oldpath moves to newpath, the data stays where it is. whatever
+// newpath named goes, if it is of the same kind and, for a dir, empty
+int fs_rename (fs_t *fs, char *oldpath, char *newpath) {
+	// assert (fs != NULL);
+	// assert (oldpath != NULL && newpath != NULL);
+
+	super_block_t *sb = fs->super_block;
+
+	int parent, child, new_parent, target;
+	char name[MAX_FILE_COMPONENT], new_name[MAX_FILE_COMPONENT];
+	if (inode_resolve (sb, oldpath, &parent, &child, name) < 0)
+		return -1;
+	if (strlen (newpath) > MAX_FILE_FULL || inode_resolve (sb, newpath, &new_parent, &target, new_name) < 0)
+		return -1;
+
+	// nothing to move, or the root on either side
+	if (child < 0 || child == INODE_ROOT_INDEX || target == INODE_ROOT_INDEX)
+		return -1;
+	if (target == child)
+		return 0;
+
+	// a dir can't go under itself
+	int index;
+	for (index = new_parent; index != INODE_ROOT_INDEX; index = sb->dir_index.nodes[index].parent)
+		if (index == child)
+			return -1;
+
+	// only a file replaces a file, and an empty dir a dir
+	if (target >= 0) {
+		if (inode_isdir (sb, child) != inode_isdir (sb, target))
+			return -1;
+		if (inode_isdir (sb, target) && !inode_isdir_isempty (sb, target))
+			return -1;
+	}
+
+	// the new dentry is written first and the old one buried last, so a rename
+	// that fails leaves both dirs as they were
+	int slot = inode_lookup_dentry (sb, parent, name);
+	dir_entry_t dentry, replaced;
+	unsigned int position;
+	if (target >= 0) {
+		// child takes over the dentry of target, nothing to allocate
+		position = inode_lookup_dentry (sb, new_parent, new_name);
+		if (fs_read (fs, new_parent, position * sizeof (dir_entry_t), &replaced, sizeof (replaced)) != sizeof (replaced))
+			return -1;
+		dentry = replaced;
+		dentry.inode = child;
+		if (fs_write (fs, new_parent, position * sizeof (dir_entry_t), &dentry, sizeof (dentry)) != sizeof (dentry))
+			return -1;
+		dir_index_remove (sb, target);
+		dir_index_remove (sb, child);
+		dir_index_insert (sb, new_parent, new_name, child, position);
+
+		// target back in its dentry if the old one can't go
+		if (inode_bury_dentry (sb, parent, slot) < 0) {
+			fs_write (fs, new_parent, position * sizeof (dir_entry_t), &replaced, sizeof (replaced));
+			dir_index_remove (sb, child);
+			dir_index_insert (sb, parent, name, child, slot);
+			dir_index_insert (sb, new_parent, new_name, target, position);
+			return -1;
+		}
+
+		inode_release (sb, target);
+		inode_free (sb, target);
+	} else if (new_parent == parent) {
+		// a new name in the same slot
+		if (fs_read (fs, parent, slot * sizeof (dir_entry_t), &dentry, sizeof (dentry)) != sizeof (dentry))
+			return -1;
+		memset (dentry.filename, 0, MAX_FILE_COMPONENT);
+		strcpy (dentry.filename, new_name);
+		if (fs_write (fs, parent, slot * sizeof (dir_entry_t), &dentry, sizeof (dentry)) != sizeof (dentry))
+			return -1;
+		dir_index_remove (sb, child);
+		dir_index_insert (sb, parent, new_name, child, slot);
+	} else {
+		// a slot in new_parent first, a tombstone again if the old one can't go
+		memset (&dentry, 0, sizeof (dentry));
+		dentry.inode = child;
+		strcpy (dentry.filename, new_name);
+		if (inode_put_dentry (sb, new_parent, &dentry, &position) != sizeof (dentry))
+			return -1;
+		sb->dir_index.nodes[new_parent].nr_of_entries++;
+		dir_index_remove (sb, child);
+		dir_index_insert (sb, new_parent, new_name, child, position);
+
+		if (inode_bury_dentry (sb, parent, slot) < 0) {
+			dir_index_remove (sb, child);
+			dir_index_insert (sb, parent, name, child, slot);
+			inode_bury_dentry (sb, new_parent, position);
+			return -1;
+		}
+	}
+
+	// every path through a dir that moved resolves differently now
+	if (inode_isdir (sb, child))
+		sb->dentry_cache.renamed++;
+
+	if (target >= 0)
+		fs_release_memory_check (fs);
+
+	return 0;
+}
 
-	// assume parent exists
-	int parent = inode_lookup_parent (sb, pathname);
-	// assert (parent >= 0);
+// child, named name in the parent dir, goes
+int inode_rm (super_block_t *sb, int parent, int child, char *name) {
+	// assert (sb != NULL);
+	// assert (name != NULL);
 
 	// assume child exists, and it is an empty entry
-	int child = inode_lookup_full (sb, pathname);
-	// assert (child >= 0);
+	// assert (inode_lookup (sb, parent, name) == child);
 	// assert (inode_isdir_isempty (sb, child) || inode_isreg (sb, child));
 
-	// get dirname
- 	char buffer[MAX_FILE_SIZE];
-	int count = path_explode (pathname, buffer);
-	char *p = path_get_component (buffer, count - 1);
-
 	// search for parent dir dentry
-	int index = inode_lookup_dentry (sb, parent, p);
+	int index = inode_lookup_dentry (sb, parent, name);
 
 	// remove it
 	inode_remove_dentry (sb, parent, index);
 
-	// chlid dir inode
+	// chlid dir inode, and its blocks
+	inode_release (sb, child);
 	inode_free (sb, child);
 
  	return 0;
 }
 
+// the only way an inode size changes, the hot copy follows
+void inode_set_size (super_block_t *sb, int index, long long size) {
+	sb->inodes[index].size = size;
+	sb->inode_hot[index].size = size;
+}
+
+void inode_set_type (super_block_t *sb, int index, char *type) {
+	strcpy (sb->inodes[index].type, type);
+
+	if (strcmp (type, INODE_TYPE_DIR) == 0)
+		sb->inode_hot[index].kind = INODE_KIND_DIR;
+	else if (strcmp (type, INODE_TYPE_REG) == 0)
+		sb->inode_hot[index].kind = INODE_KIND_REG;
+	else
+		sb->inode_hot[index].kind = INODE_KIND_NONE;
+}
+
 int inode_isdir_isempty (super_block_t *sb, int index) {
-	return sb->inodes[index].size == 0 && inode_isdir (sb, index);
+	return sb->inode_hot[index].size == 0 && inode_isdir (sb, index);
 }
 
 int inode_isdir (super_block_t *sb, int index) {
-	return strcmp (sb->inodes[index].type, INODE_TYPE_DIR) == 0;
+	return sb->inode_hot[index].kind == INODE_KIND_DIR;
 }
 
 int inode_isreg (super_block_t *sb, int index) {
-	return strcmp (sb->inodes[index].type, INODE_TYPE_REG) == 0;
+	return sb->inode_hot[index].kind == INODE_KIND_REG;
 }
 
 int inode_lookup_dentry (super_block_t *sb, int inode, char *component) {
@@ -285,26 +680,15 @@ int inode_lookup_dentry (super_block_t *sb, int inode, char *component) {
 	// assert (inode_isdir (sb, inode));
 	// assert (component != NULL);
 
-	dir_entry_t dentry;
-	int offset = 0;
-	int index = 0;
-	int status = fs_read (sb->fs, inode, offset, &dentry, sizeof (dentry));
-
-	while (status == sizeof(dentry)) {
-		if (strcmp (dentry.filename, component) == 0)
-			break;
-
-		index++;
-		offset += sizeof (dentry);
-		status = fs_read (sb->fs, inode, offset, &dentry, sizeof (dentry));
-	}
-
-	if (status != sizeof (dentry))
+	int child = dir_index_lookup (sb, inode, component);
+	if (child < 0)
 		return -1;
 
-	return index;
+	return sb->dir_index.nodes[child].position;
 }
 
+// the slot becomes a tombstone, the entries around it stay where they are
+// while the dir is open
 int inode_remove_dentry (super_block_t *sb, int inode, int dentry) {
 
 	// assert (sb != NULL);
@@ -316,177 +700,615 @@ int inode_remove_dentry (super_block_t *sb, int inode, int dentry) {
 	// assert (sb->inodes[inode].size >= dentry * sizeof (dir_entry_t));
 
 	dir_entry_t buffer;
-	int offset = (dentry + 1) * sizeof (dir_entry_t);
-	
-	int status;
-	status = fs_read (sb->fs, inode, offset, &buffer, sizeof (dir_entry_t));
-
-	while (status == sizeof (dir_entry_t)) {
-		fs_write (sb->fs, inode, offset - sizeof (dir_entry_t), &buffer, sizeof (dir_entry_t));
-		offset += sizeof (dir_entry_t);
-		status = fs_read (sb->fs, inode, offset, &buffer, sizeof (dir_entry_t));
-	}
+	int offset = dentry * sizeof (dir_entry_t);
 
-	inode_shrink (sb, inode, sb->inodes[inode].size - sizeof (dir_entry_t));
+	int status = fs_read (sb->fs, inode, offset, &buffer, sizeof (dir_entry_t));
+	if (status != sizeof (dir_entry_t))
+		return -1;
+	if (inode_bury_dentry (sb, inode, dentry) < 0)
+		return -1;
+	dir_index_remove (sb, buffer.inode);
 
 	return 0;
 }
 
-int inode_lookup (super_block_t *sb, int parent, char *childname) {
+// a counted dentry of dir inode becomes a tombstone, whoever it named is for
+// the caller to take out of the index. -1 if the slot can't be written, and
+// nothing changes then
+int inode_bury_dentry (super_block_t *sb, int inode, int dentry) {
 	// assert (sb != NULL);
-	// assert (childname != NULL);
-
-	index_node_t *inode = &sb->inodes[parent];
-	
-	// not exist
-	if (inode->in_use == 0)
-		return -1;
-
-	// not a dir
-	if (strcmp (inode->type, INODE_TYPE_DIR) != 0)
-		return -1;
+	// assert (inode_isdir (sb, inode));
 
-	dir_entry_t dentry;
-	int offset = 0;
-	int status = fs_read (sb->fs, parent, offset, &dentry, sizeof (dentry));
-		
-	// empty dir	
-	if (status == 0)
-		return -1;
+	dir_index_node_t *dir = &sb->dir_index.nodes[inode];
+	int offset = dentry * sizeof (dir_entry_t);
 
-	while (status == sizeof(dentry)) {
-		if (strcmp (dentry.filename, childname) == 0)
-			return dentry.inode;
+	// the last one, tombstones and all go
+	if (dir->nr_of_entries == 1) {
+		dir->nr_of_entries = 0;
+		dir->free_slot = -1;
+		inode_shrink (sb, inode, 0);
+		return 0;
+	}
 
-		offset += sizeof (dentry);
-		status = fs_read (sb->fs, parent, offset, &dentry, sizeof (dentry));
+	// the last slot is cut, and with it the tombstones just below it as long as
+	// they are first on the list. no live dentry moves
+	long long slots = sb->inodes[inode].size / sizeof (dir_entry_t);
+	if (dentry == slots - 1) {
+		dir_tombstone_t tombstone;
+		while (--slots > 0 && dir->free_slot == slots - 1 &&
+				fs_read (sb->fs, inode, (slots - 1) * sizeof (dir_entry_t), &tombstone, sizeof (tombstone)) == sizeof (tombstone) &&
+				tombstone.inode == INODE_ROOT_INDEX)
+			dir->free_slot = tombstone.next;
+		inode_shrink (sb, inode, slots * sizeof (dir_entry_t));
+	} else {
+		dir_tombstone_t tombstone;
+		memset (&tombstone, 0, sizeof (tombstone));
+		tombstone.inode = INODE_ROOT_INDEX;
+		tombstone.next = dir->free_slot;
+		if (fs_write (sb->fs, inode, offset, &tombstone, sizeof (tombstone)) != sizeof (tombstone))
+			return -1;
+		dir->free_slot = dentry;
 	}
+	dir->nr_of_entries--;
 
-	// not found
-	return -1;
+	// more holes than names, close them up if no listing can be under way
+	if (dir->nr_of_opens == 0 && sb->inodes[inode].size / sizeof (dir_entry_t) - dir->nr_of_entries > dir->nr_of_entries)
+		inode_compact_dir (sb, inode);
+
+	return 0;
 }
 
-int inode_lookup_full (super_block_t *sb, char *fullname) {
-	// assert (sb != NULL);
-	// assert (fullname != NULL);
+// a dir opened, its dentries stay in their slots until the last close
+void inode_open_dir (super_block_t *sb, int inode) {
+	sb->dir_index.nodes[inode].nr_of_opens++;
+}
 
-	if (strcmp (fullname, "/") == 0)
-		return 0;
+// the last close compacts a dir that was left with more holes than names
+void inode_close_dir (super_block_t *sb, int inode) {
+	dir_index_node_t *dir = &sb->dir_index.nodes[inode];
 
-	int index = 0;
+	if (--dir->nr_of_opens == 0 && inode_isdir (sb, inode) && dir->nr_of_entries > 0 &&
+			sb->inodes[inode].size / sizeof (dir_entry_t) - dir->nr_of_entries > dir->nr_of_entries)
+		inode_compact_dir (sb, inode);
+}
 
-	// assert (strlen (fullname) < MAX_FILE_SIZE);
-	char *buffer = malloc (MAX_FILE_SIZE * sizeof(char));
-	int count = path_explode (fullname, buffer);
+// the live dentries at the tail of a dir move into the holes nearest the head,
+// then the tail goes. only for a dir nobody has open, a listing would miss
+// the ones that moved
+void inode_compact_dir (super_block_t *sb, int inode) {
+	// assert (sb != NULL);
+	// assert (inode_isdir (sb, inode));
 
-	char *p = buffer;
-	int i;
-	for (i = 0; i < count; i++) {
-		int len = strlen (p);
-		index = inode_lookup (sb, index, p);
+	dir_index_node_t *dir = &sb->dir_index.nodes[inode];
+	dir_entry_t hole, entry;
+	long long low = 0, high = sb->inodes[inode].size / sizeof (dir_entry_t) - 1;
 
-		// not found
-		if (index == -1) {
-			free (buffer);
-			return -1;
+	while (low < high) {
+		if (fs_read (sb->fs, inode, low * sizeof (dir_entry_t), &hole, sizeof (hole)) != sizeof (hole))
+			return;
+		if (hole.inode != INODE_ROOT_INDEX) {
+			low++;
+			continue;
+		}
+		if (fs_read (sb->fs, inode, high * sizeof (dir_entry_t), &entry, sizeof (entry)) != sizeof (entry))
+			return;
+		if (entry.inode == INODE_ROOT_INDEX) {
+			high--;
+			continue;
 		}
 
-		p += len + 1;
+		if (fs_write (sb->fs, inode, low * sizeof (dir_entry_t), &entry, sizeof (entry)) != sizeof (entry))
+			return;
+		sb->dir_index.nodes[entry.inode].position = low;
+		low++;
+		high--;
 	}
 
-	free (buffer);
-	return index;
+	// only tombstones past the names, the list goes with them
+	dir->free_slot = -1;
+	inode_shrink (sb, inode, (long long)dir->nr_of_entries * sizeof (dir_entry_t));
 }
 
-int inode_lookup_parent (super_block_t *sb, char *child) {
+// the live dentries of a dir from slot on, as many as fit in nr_of_entries.
+// slot moves past the ones read, tombstones included, so the next call goes on
+// from there
+int inode_readdir (super_block_t *sb, int inode, unsigned int *slot, dir_entry_t *entries, int nr_of_entries) {
 	// assert (sb != NULL);
-	// assert (child != NULL);
-
-	if (strcmp (child, "/") == 0)
-		return 0;
-
-	int index = 0;
+	// assert (inode_isdir (sb, inode));
 
-	// assert (strlen (child) < MAX_FILE_SIZE);
-	char *buffer = malloc (MAX_FILE_SIZE * sizeof(char));
-	int count = path_explode (child, buffer);
+	int count = 0;
 
-	char *p = buffer;
-	int i;
-	for (i = 0; i < count - 1; i++) {
-		int len = strlen (p);
-		index = inode_lookup (sb, index, p);
+	while (count < nr_of_entries) {
+		long long status = fs_read (sb->fs, inode, (long long)*slot * sizeof (dir_entry_t),
+			&entries[count], (nr_of_entries - count) * sizeof (dir_entry_t));
+		if (status < (long long)sizeof (dir_entry_t))
+			break;
 
-		// not found or found but not dir
-		if (index == -1 || strcmp (sb->inodes[index].type, INODE_TYPE_DIR) != 0) {
-			free (buffer);
-			return -1;
-		}
+		// squeeze out the tombstones
+		int read = status / sizeof (dir_entry_t);
+		int i, live = count;
+		for (i = count; i < count + read; i++)
+			if (entries[i].inode != INODE_ROOT_INDEX)
+				entries[live++] = entries[i];
 
-		p += len + 1;
+		*slot += read;
+		count = live;
 	}
 
-	free (buffer);
-	return index;
+	return count;
 }
 
-int inode_allocate (super_block_t *sb) {
+int inode_lookup (super_block_t *sb, int parent, char *childname) {
 	// assert (sb != NULL);
+	// assert (childname != NULL);
 
-	if (sb->free_inodes == 0)
+	inode_hot_t *inode = &sb->inode_hot[parent];
+	
+	// not exist
+	if (inode->in_use == 0)
 		return -1;
 
-	int i;
-	for (i = 1; i < INODE_ARRAY_SIZE; i++) {
-		if (sb->inodes[i].in_use == 0) {
-			memset (&sb->inodes[i], 0, sizeof (index_node_t));
-			sb->inodes[i].in_use == 1;
-			sb->free_inodes--;
-			return i;
-		}
-	}
+	// not a dir
+	if (inode->kind != INODE_KIND_DIR)
+		return -1;
 
-	return -1;
+	return dir_index_lookup (sb, parent, childname);
 }
 
-int inode_free (super_block_t *sb, int index) {
-	// assert (sb != NULL);
+static unsigned int dir_index_hash (int parent, char *name) {
+	unsigned int hash = 2166136261u ^ parent;
+	int i;
 
-	memset (&sb->inodes[index], 0, sizeof (index_node_t));
-	sb->free_inodes++;
+	// fnv-1a
+	for (i = 0; i < MAX_FILE_COMPONENT && name[i] != 0; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
 
-	return 0;
+	return hash;
 }
 
-char* path_get_component (char *components, int index) {
-	char *p = components;
-	int len;
+// order of node against the name in parent
+static int dir_tree_compare (dir_index_node_t *node, int parent, char *name) {
+	if (node->parent != parent)
+		return node->parent < parent ? -1 : 1;
 
-	int i;
-	for (i = 0; i < index; i++) {
-		len = strlen (p);
-		p += len + 1;
+	return strncmp (node->filename, name, MAX_FILE_COMPONENT);
+}
+
+// heap order of the treap, a scramble of the child so it does not follow the names
+static unsigned int dir_tree_priority (int child) {
+	unsigned int x = child * 2654435761u;
+	return x ^ (x >> 16);
+}
+
+// the treap at t into the names below the name in parent and the rest, or with
+// inclusive set into the ones up to it and the rest
+static void dir_tree_split (dir_index_t *dir_index, int t, int parent, char *name, int inclusive, int *left, int *right) {
+	if (t < 0) {
+		*left = -1;
+		*right = -1;
+		return;
 	}
 
-	return p;
+	dir_index_node_t *node = &dir_index->nodes[t];
+	int order = dir_tree_compare (node, parent, name);
+	if (order < 0 || (inclusive && order == 0)) {
+		dir_tree_split (dir_index, node->right, parent, name, inclusive, &node->right, right);
+		*left = t;
+	} else {
+		dir_tree_split (dir_index, node->left, parent, name, inclusive, left, &node->left);
+		*right = t;
+	}
 }
 
-int path_explode (char *path, char *components) {
-	// assert (path != NULL && components != NULL);
+// one treap of two, every name of left below every name of right
+static int dir_tree_merge (dir_index_t *dir_index, int left, int right) {
+	if (left < 0)
+		return right;
+	if (right < 0)
+		return left;
 
-	char *p = path;
-	char *q = components;
+	if (dir_tree_priority (left) > dir_tree_priority (right)) {
+		dir_index->nodes[left].right = dir_tree_merge (dir_index, dir_index->nodes[left].right, right);
+		return left;
+	}
 
-	// start from root
-	// assert (*p == PATH_DELIMITER_CHAR);
+	dir_index->nodes[right].left = dir_tree_merge (dir_index, left, dir_index->nodes[right].left);
+	return right;
+}
 
-	// skip root
-	p++;
+// in order, the children of parent above low (or from it, if inclusive) and
+// below high, high NULL for no bound. only the paths to the ends are walked
+static void dir_tree_scan (dir_index_t *dir_index, int t, int parent, char *low, int inclusive, char *high,
+		dir_entry_t *entries, int nr_of_entries, int *count) {
+	if (t < 0 || *count == nr_of_entries)
+		return;
+
+	dir_index_node_t *node = &dir_index->nodes[t];
+	int above_low = dir_tree_compare (node, parent, low);
+	int below_high = high == NULL ? node->parent <= parent : dir_tree_compare (node, parent, high) < 0;
+	above_low = above_low > 0 || (inclusive && above_low == 0);
+
+	if (above_low)
+		dir_tree_scan (dir_index, node->left, parent, low, inclusive, high, entries, nr_of_entries, count);
+
+	if (above_low && below_high && node->parent == parent && *count < nr_of_entries) {
+		memcpy (entries[*count].filename, node->filename, MAX_FILE_COMPONENT);
+		entries[*count].inode = t;
+		(*count)++;
+	}
 
-	// copy, and replace / with \0
-	int count = 0;
-	while (*p != 0) {
-		if (*p == PATH_DELIMITER_CHAR)
+	if (below_high)
+		dir_tree_scan (dir_index, node->right, parent, low, inclusive, high, entries, nr_of_entries, count);
+}
+
+// the children of dir inode in range, in name order, as many as fit. the cursor
+// moves to the last one so the next call goes on from there
+int inode_scandir (super_block_t *sb, int inode, dir_range_t *range, dir_entry_t *entries, int nr_of_entries) {
+	// assert (sb != NULL);
+	// assert (inode_isdir (sb, inode));
+
+	char from[MAX_FILE_COMPONENT], to[MAX_FILE_COMPONENT];
+	strncpy (from, range->from, MAX_FILE_COMPONENT);
+	from[MAX_FILE_COMPONENT - 1] = '\0';
+	strncpy (to, range->prefix ? range->from : range->to, MAX_FILE_COMPONENT);
+	to[MAX_FILE_COMPONENT - 1] = '\0';
+	range->cursor[MAX_FILE_COMPONENT - 1] = '\0';
+
+	// everything with a prefix sorts below the prefix with its last byte bumped
+	char *high = to;
+	if (range->prefix) {
+		int len = strlen (to);
+		while (len > 0 && (unsigned char)to[len - 1] == 0xff)
+			to[--len] = '\0';
+		if (len == 0)
+			high = NULL;
+		else
+			to[len - 1]++;
+	} else if (to[0] == '\0')
+		high = NULL;
+
+	// past the cursor, unless it is still below from
+	char *low = from;
+	int inclusive = 1;
+	if (range->cursor[0] != '\0' && strncmp (range->cursor, from, MAX_FILE_COMPONENT) >= 0) {
+		low = range->cursor;
+		inclusive = 0;
+	}
+
+	int count = 0;
+	dir_tree_scan (&sb->dir_index, sb->dir_index.root, inode, low, inclusive, high, entries, nr_of_entries, &count);
+
+	if (count > 0)
+		memcpy (range->cursor, entries[count - 1].filename, MAX_FILE_COMPONENT);
+
+	return count;
+}
+
+// a bucket per inode or more, all empty
+int dir_index_init (super_block_t *sb) {
+	dir_index_t *dir_index = &sb->dir_index;
+	unsigned int nr_of_buckets = 1, i;
+
+	while (nr_of_buckets < sb->geometry.nr_of_inodes)
+		nr_of_buckets <<= 1;
+
+	dir_index->mask = nr_of_buckets - 1;
+	dir_index->buckets = malloc (nr_of_buckets * sizeof (int));
+	dir_index->nodes = malloc (sb->geometry.nr_of_inodes * sizeof (dir_index_node_t));
+	if (dir_index->buckets == NULL || dir_index->nodes == NULL)
+		return -1;
+
+	for (i = 0; i < nr_of_buckets; i++)
+		dir_index->buckets[i] = -1;
+	memset (dir_index->nodes, 0, sb->geometry.nr_of_inodes * sizeof (dir_index_node_t));
+	for (i = 0; i < sb->geometry.nr_of_inodes; i++)
+		dir_index->nodes[i].free_slot = -1;
+	dir_index->root = -1;
+
+	return 0;
+}
+
+void dir_index_destroy (super_block_t *sb) {
+	free (sb->dir_index.buckets);
+	free (sb->dir_index.nodes);
+}
+
+// child now has a dentry named name at position in parent
+void dir_index_insert (super_block_t *sb, int parent, char *name, int child, unsigned int position) {
+	dir_index_t *dir_index = &sb->dir_index;
+	dir_index_node_t *node = &dir_index->nodes[child];
+	unsigned int bucket = dir_index_hash (parent, name) & dir_index->mask;
+
+	strncpy (node->filename, name, MAX_FILE_COMPONENT);
+	node->parent = parent;
+	dir_index->nodes[parent].generation++;
+	node->position = position;
+	node->next = dir_index->buckets[bucket];
+	dir_index->buckets[bucket] = child;
+
+	// in the name order, between the names below it and the rest
+	int left, right;
+	node->left = -1;
+	node->right = -1;
+	dir_tree_split (dir_index, dir_index->root, parent, name, 0, &left, &right);
+	dir_index->root = dir_tree_merge (dir_index, dir_tree_merge (dir_index, left, child), right);
+}
+
+// the child named name in parent, -1 if none
+int dir_index_lookup (super_block_t *sb, int parent, char *name) {
+	dir_index_t *dir_index = &sb->dir_index;
+	int child = dir_index->buckets[dir_index_hash (parent, name) & dir_index->mask];
+
+	while (child >= 0) {
+		dir_index_node_t *node = &dir_index->nodes[child];
+		if (node->parent == parent && strncmp (node->filename, name, MAX_FILE_COMPONENT) == 0)
+			return child;
+		child = node->next;
+	}
+
+	return -1;
+}
+
+// the dentry of child is gone
+void dir_index_remove (super_block_t *sb, int child) {
+	dir_index_t *dir_index = &sb->dir_index;
+	dir_index_node_t *node = &dir_index->nodes[child];
+	int *p = &dir_index->buckets[dir_index_hash (node->parent, node->filename) & dir_index->mask];
+
+	while (*p >= 0 && *p != child)
+		p = &dir_index->nodes[*p].next;
+	if (*p == child)
+		*p = node->next;
+
+	// cut it out of the name order, it is all there is between the two halves
+	int left, middle, right;
+	dir_tree_split (dir_index, dir_index->root, node->parent, node->filename, 0, &left, &right);
+	dir_tree_split (dir_index, right, node->parent, node->filename, 1, &middle, &right);
+	dir_index->root = dir_tree_merge (dir_index, left, right);
+
+	// only its dentry goes, what it holds as a directory stays. misses cached
+	// under it must not outlive it
+	unsigned int nr_of_entries = node->nr_of_entries;
+	int free_slot = node->free_slot;
+	unsigned int generation = node->generation;
+	unsigned int nr_of_opens = node->nr_of_opens;
+	memset (node, 0, sizeof (dir_index_node_t));
+	node->nr_of_entries = nr_of_entries;
+	node->free_slot = free_slot;
+	node->generation = generation + 1;
+	node->nr_of_opens = nr_of_opens;
+}
+
+static unsigned int dentry_cache_hash (char *path, int parent) {
+	unsigned int hash = 2166136261u ^ parent;
+
+	// fnv-1a
+	while (*path != 0)
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+
+	return hash;
+}
+
+// 1 and the inode, -1 included, if what path resolved to still holds
+int dentry_cache_lookup (super_block_t *sb, char *path, int parent, int *inode) {
+	dentry_cache_t *cache = &sb->dentry_cache;
+	if (cache->entries == NULL)
+		return 0;
+
+	dentry_cache_entry_t *entry = &cache->entries[dentry_cache_hash (path, parent) & (DENTRY_CACHE_SIZE - 1)];
+	if (entry->path[0] == 0 || entry->parent != parent || strcmp (entry->path, path) != 0)
+		return 0;
+	if (entry->renamed != cache->renamed)
+		return 0;
+
+	if (entry->dir >= 0 && entry->inode >= 0) {
+		// a hit: the dentry looked up is still there under the same name
+		dir_index_node_t *node = &sb->dir_index.nodes[entry->inode];
+		if (!sb->inode_hot[entry->inode].in_use || node->parent != entry->dir)
+			return 0;
+		if (strncmp (node->filename, entry->path + entry->component, entry->length) != 0 || node->filename[entry->length] != '\0')
+			return 0;
+	} else if (entry->dir >= 0) {
+		// a miss: nothing came into the dir it failed in
+		if (sb->dir_index.nodes[entry->dir].generation != entry->generation)
+			return 0;
+	}
+
+	*inode = entry->inode;
+	return 1;
+}
+
+// the slot goes to the latest path that hashes to it. dir is where the lookup
+// that decided inode went, for the length bytes at component
+void dentry_cache_store (super_block_t *sb, char *path, int parent, int inode, int dir, char *component, int length) {
+	dentry_cache_t *cache = &sb->dentry_cache;
+	if (cache->entries == NULL || strlen (path) > MAX_FILE_FULL)
+		return;
+
+	dentry_cache_entry_t *entry = &cache->entries[dentry_cache_hash (path, parent) & (DENTRY_CACHE_SIZE - 1)];
+	strcpy (entry->path, path);
+	entry->parent = parent;
+	entry->inode = inode;
+	entry->dir = dir;
+	entry->component = dir >= 0 ? component - path : 0;
+	entry->length = dir >= 0 ? length : 0;
+	entry->generation = dir >= 0 ? sb->dir_index.nodes[dir].generation : 0;
+	entry->renamed = cache->renamed;
+}
+
+// where pathname leads in one pass: the dir it is in, the inode itself, -1 if
+// there is none, and its last component. -1 if the dir does not exist or the
+// last component is too long to name anything. a caller that only wants one
+// of parent and child passes NULL for the other, and a cached answer for it is
+// enough; the return value then only speaks for what was asked
+int inode_resolve (super_block_t *sb, char *pathname, int *parent, int *child, char *name) {
+	// assert (sb != NULL);
+	// assert (pathname != NULL);
+	// assert (*pathname == PATH_DELIMITER_CHAR);
+
+	int parent_unused, child_unused;
+	int want_parent = parent != NULL, want_child = child != NULL;
+	if (parent == NULL)
+		parent = &parent_unused;
+	if (child == NULL)
+		child = &child_unused;
+
+	*parent = -1;
+	*child = -1;
+	name[0] = '\0';
+
+	int len = strlen (pathname);
+	if (len == 0)
+		return -1;
+	if (strcmp (pathname, "/") == 0) {
+		*parent = INODE_ROOT_INDEX;
+		*child = INODE_ROOT_INDEX;
+		return 0;
+	}
+
+	// the last component, a trailing delimiter does not start one
+	char *end = pathname + len;
+	if (end[-1] == PATH_DELIMITER_CHAR)
+		end--;
+	char *last = end;
+	while (last > pathname + 1 && last[-1] != PATH_DELIMITER_CHAR)
+		last--;
+
+	int valid = end - last < MAX_FILE_COMPONENT;
+	if (valid) {
+		memcpy (name, last, end - last);
+		name[end - last] = '\0';
+	}
+
+	if ((!want_parent || dentry_cache_lookup (sb, pathname, 1, parent)) && (!want_child || dentry_cache_lookup (sb, pathname, 0, child))) {
+		if (!want_parent)
+			return *child >= 0 ? 0 : -1;
+		return *parent >= 0 && valid ? 0 : -1;
+	}
+
+	// the components before it, in place. the last lookup was in dir, for the
+	// length bytes at looked
+	char component[MAX_FILE_COMPONENT];
+	char *p = pathname + 1, *looked = p;
+	int index = INODE_ROOT_INDEX, dir = -1, length = 0;
+	while (p < last) {
+		char *q = p;
+		while (*q != PATH_DELIMITER_CHAR)
+			q++;
+
+		// longer than any name, or not found, or found but not dir
+		dir = index;
+		looked = p;
+		length = q - p;
+		if (q - p >= MAX_FILE_COMPONENT) {
+			index = -1;
+			break;
+		}
+		memcpy (component, p, q - p);
+		component[q - p] = '\0';
+		index = inode_lookup (sb, index, component);
+		if (index == -1 || !inode_isdir (sb, index)) {
+			index = -1;
+			break;
+		}
+
+		p = q + 1;
+	}
+
+	*parent = index;
+	dentry_cache_store (sb, pathname, 1, *parent, dir, looked, length);
+
+	if (index >= 0) {
+		dir = index;
+		if (valid)
+			*child = inode_lookup (sb, index, name);
+	}
+	dentry_cache_store (sb, pathname, 0, *child, dir, last, end - last);
+
+	if (!want_parent)
+		return *child >= 0 ? 0 : -1;
+	return *parent >= 0 && valid ? 0 : -1;
+}
+
+int inode_lookup_full (super_block_t *sb, char *fullname) {
+	// assert (sb != NULL);
+	// assert (fullname != NULL);
+
+	int child;
+	char name[MAX_FILE_COMPONENT];
+	inode_resolve (sb, fullname, NULL, &child, name);
+
+	return child;
+}
+
+int inode_lookup_parent (super_block_t *sb, char *child) {
+	// assert (sb != NULL);
+	// assert (child != NULL);
+
+	int parent;
+	char name[MAX_FILE_COMPONENT];
+	inode_resolve (sb, child, &parent, NULL, name);
+
+	return parent;
+}
+
+// pop the free inode stack
+int inode_allocate (super_block_t *sb) {
+	// assert (sb != NULL);
+
+	if (sb->free_inodes == 0)
+		return -1;
+
+	int i = sb->free_inode_stack[--sb->free_inodes];
+	memset (&sb->inodes[i], 0, sizeof (index_node_t));
+	sb->inodes[i].in_use = 1;
+	memset (&sb->inode_hot[i], 0, sizeof (inode_hot_t));
+	sb->inode_hot[i].in_use = 1;
+
+	return i;
+}
+
+// push back on the free inode stack
+int inode_free (super_block_t *sb, int index) {
+	// assert (sb != NULL);
+	// assert (index != INODE_ROOT_INDEX);
+
+	memset (&sb->inodes[index], 0, sizeof (index_node_t));
+	memset (&sb->inode_hot[index], 0, sizeof (inode_hot_t));
+	sb->free_inode_stack[sb->free_inodes++] = index;
+
+	return 0;
+}
+
+char* path_get_component (char *components, int index) {
+	char *p = components;
+	int len;
+
+	int i;
+	for (i = 0; i < index; i++) {
+		len = strlen (p);
+		p += len + 1;
+	}
+
+	return p;
+}
+
+int path_explode (char *path, char *components) {
+	// assert (path != NULL && components != NULL);
+
+	char *p = path;
+	char *q = components;
+
+	// start from root
+	// assert (*p == PATH_DELIMITER_CHAR);
+
+	// skip root
+	p++;
+
+	// copy, and replace / with \0
+	int count = 0;
+	while (*p != 0) {
+		if (*p == PATH_DELIMITER_CHAR)
 			*q = '\0', count++;
 		else 
 			*q = *p;
@@ -505,9 +1327,9 @@ int path_explode (char *path, char *components) {
 	return count;
 }
 
-int fs_read (fs_t *fs, int index, int offset, void *buffer, int len) {
+long long fs_read (fs_t *fs, int index, long long offset, void *buffer, long long len) {
 	// assert (fs != NULL);
-	// assert (index >= 0 && index < INODE_ARRAY_SIZE);
+	// assert (index >= 0 && index < sb->geometry.nr_of_inodes);
 	// assert (buffer != NULL);
 	// assert (offset >= 0);
 	// assert (len >= 0);
@@ -519,15 +1341,15 @@ int fs_read (fs_t *fs, int index, int offset, void *buffer, int len) {
 	if (offset >= inode->size)
 		return 0;
 
-	int to_read = inode->size - offset;
+	long long to_read = inode->size - offset;
 	to_read = to_read > len ? len : to_read;
 
 	return inode_read (fs->super_block, index, offset, buffer, to_read);
 }
 
-int fs_write (fs_t *fs, int index, int offset, void *buffer, int len) {
+long long fs_write (fs_t *fs, int index, long long offset, void *buffer, long long len) {
 	// assert (fs != NULL);
-	// assert (index >= 0 && index < INODE_ARRAY_SIZE);
+	// assert (index >= 0 && index < sb->geometry.nr_of_inodes);
 	// assert (buffer != NULL);
 	// assert (offset >= 0);
 	// assert (len >= 0);
@@ -535,161 +1357,197 @@ int fs_write (fs_t *fs, int index, int offset, void *buffer, int len) {
 	index_node_t *inode = &fs->super_block->inodes[index];
 	// assert (inode->in_use == 1);
 
-	if (offset + len > LOC_LIMIT_DOUBLE_INDIRECT)
+	if (offset + len > inode_max_size (fs->super_block, index))
 		return -1;
 
-	int status;
-	if (inode->size < offset + len) {
-		status = inode_expand (fs->super_block, index, offset + len);
-		if (status < 0)
+	// the data outgrows the inode
+	if ((inode->flags & INODE_FLAG_INLINE) && offset + len > INODE_INLINE_DATA_SIZE) {
+		if (inode_uninline (fs->super_block, index) < 0)
 			return -1;
 	}
 
+	// blocks for the bytes written only, whatever is skipped over stays a hole
+	if (!(inode->flags & INODE_FLAG_INLINE) && inode_map (fs->super_block, index, offset, len) < 0)
+		return -1;
+
+	if (inode->size < offset + len && inode_expand (fs->super_block, index, offset + len) < 0)
+		return -1;
+
 	return inode_write (fs->super_block, index, offset, buffer, len);
 }
 
-int fs_append (fs_t *fs, int index, void *buffer, int len) {
+long long fs_append (fs_t *fs, int index, void *buffer, long long len) {
 	// assert (fs != NULL);
-	// assert (index >= 0 && index < INODE_ARRAY_SIZE);
+	// assert (index >= 0 && index < sb->geometry.nr_of_inodes);
 	// assert (buffer != NULL);
 	// assert (len >= 0);
 
 	index_node_t *inode = &fs->super_block->inodes[index];
 	// assert (inode->in_use == 1);
 
-	int prev = inode->size;
-	int status = fs_write (fs, index, inode->size, buffer, len);
+	long long prev = inode->size;
+	long long status = fs_write (fs, index, inode->size, buffer, len);
 	// assert (inode->size == prev + status);
 
 	return status;
 }
 
-int inode_append (super_block_t *sb, int index, void *buffer, int len) {
+long long inode_append (super_block_t *sb, int index, void *buffer, long long len) {
 	// assert (sb != NULL);
-	// assert (index >= 0 && index < INODE_ARRAY_SIZE);
+	// assert (index >= 0 && index < sb->geometry.nr_of_inodes);
 	// assert (buffer != NULL);
 	// assert (len >= 0);
 
-	int offset = sb->inodes[index].size;
+	long long offset = sb->inodes[index].size;
 	return inode_write (sb, index, offset, buffer, len);
 }
 
-int inode_write (super_block_t *sb, int index, int offset, void *buffer, int len) {
+long long inode_write (super_block_t *sb, int index, long long offset, void *buffer, long long len) {
 	// assert (sb != NULL);
 	// assert (buffer != NULL);
 	// assert (len >= 0);
 	// assert (index >= 0);
-	// assert (index < INODE_ARRAY_SIZE);
+	// assert (index < sb->geometry.nr_of_inodes);
 	// assert (offset >= 0);
 
-	int total_len = len;
-
-	index_node_t *inode = &sb->inodes[index];
-	location_t *location = &inode->location;
+	long long total_len = len, to_copy;
 
-	// assert (inode->size >= (offset + len));
+	// assert (sb->inodes[index].size >= (offset + len));
 
 	void *src, *dst;
-	int to_copy;
 
-	// first 
+	// one copy per contiguous run, a block or a whole extent
 	src = buffer;
-	dst = loc_locate (location, offset);
-	to_copy = (offset / BLOCK_SIZE_IN_B + 1) * BLOCK_SIZE_IN_B - offset;
-	to_copy = to_copy > len ? len : to_copy;
-	// printf ("Writing: %p, %d\n", dst, to_copy);
+	while (len > 0) {
+		dst = inode_locate (sb, index, offset, &to_copy);
+		to_copy = to_copy > len ? len : to_copy;
+		// printf ("Writing: %p, %d\n", dst, to_copy);
+		memcpy (dst, src, to_copy);
+
+		src += to_copy;
+		offset += to_copy;
+		len -= to_copy;
+	}
+
+	return total_len;
+}
+
+// zero a range of an inode, holes are left alone
+long long inode_zero (super_block_t *sb, int index, long long offset, long long len) {
+	// assert (sb != NULL);
+	// assert (offset >= 0);
+	// assert (len >= 0);
 
-	memcpy (dst, src, to_copy);
+	long long total_len = len, to_zero;
+	void *dst;
 
-	offset += to_copy;
-	src += to_copy;
-	len -= to_copy;
+	while (len > 0) {
+		dst = inode_locate (sb, index, offset, &to_zero);
+		to_zero = to_zero > len ? len : to_zero;
 
-	// second to second last
-	while (len > BLOCK_SIZE_IN_B) {
-		dst = loc_locate (location, offset);
-	// printf ("Writing: %p, %d\n", dst, BLOCK_SIZE_IN_B);
-		memcpy (dst, src, BLOCK_SIZE_IN_B);
+		// a hole reads as zero already
+		if (dst != NULL)
+			memset (dst, 0, to_zero);
 
-		src += BLOCK_SIZE_IN_B;
-		offset += BLOCK_SIZE_IN_B;
-		len -= BLOCK_SIZE_IN_B;
+		offset += to_zero;
+		len -= to_zero;
 	}
 
-	// last
-	dst = loc_locate (location, offset);
-	// printf ("Writing: %p, %d\n", dst, len);
-	memcpy (dst, src, len);
-
 	return total_len;
 }
 
-int inode_read (super_block_t *sb, int index, int offset, void *buffer, int len) {
+long long inode_read (super_block_t *sb, int index, long long offset, void *buffer, long long len) {
 	// assert (sb != NULL 
 	// assert (buffer != NULL);
 	// assert (len >= 0);
 	// assert (index >= 0);
-	// assert (index < INODE_ARRAY_SIZE);
+	// assert (index < sb->geometry.nr_of_inodes);
 	// assert (offset >= 0);
 
-	index_node_t *inode = &sb->inodes[index];
-	location_t *location = &inode->location;
-
-	int total_len = len;
+	long long total_len = len, to_copy;
 
-	// assert (inode->size >= (offset + len));
+	// assert (sb->inodes[index].size >= (offset + len));
 
 	void *src, *dst;
-	int to_copy;
 
-	// first 
+	// one copy per contiguous run, a block or a whole extent
 	dst = buffer;
-	src = loc_locate (location, offset);
-	to_copy = (offset / BLOCK_SIZE_IN_B + 1) * BLOCK_SIZE_IN_B - offset;
-	to_copy = to_copy > len ? len : to_copy;
-	memcpy (dst, src, to_copy);
-
-	offset += to_copy;
-	dst += to_copy;
-	len -= to_copy;
-
-	// second to second last
-	while (len > BLOCK_SIZE_IN_B) {
-		src = loc_locate (location, offset);
-		memcpy (dst, src, BLOCK_SIZE_IN_B);
-
-		dst += BLOCK_SIZE_IN_B;
-		offset += BLOCK_SIZE_IN_B;
-		len -= BLOCK_SIZE_IN_B;
+	while (len > 0) {
+		src = inode_locate (sb, index, offset, &to_copy);
+		to_copy = to_copy > len ? len : to_copy;
+
+		// a hole reads as zero
+		if (src == NULL)
+			memset (dst, 0, to_copy);
+		else
+			memcpy (dst, src, to_copy);
+
+		dst += to_copy;
+		offset += to_copy;
+		len -= to_copy;
 	}
 
-	// last
-	src = loc_locate (location, offset);
-	memcpy (dst, src, len);
-
 	return total_len;
 }
 
-int inode_resize (super_block_t *sb, int index, int size) {
+// address of the byte at offset, and in run how many bytes follow it contiguously.
+// NULL in a hole, run is then the rest of the block
+void* inode_locate (super_block_t *sb, int index, long long offset, long long *run) {
 	// assert (sb != NULL);
-	// assert (index >=0 && index < INODE_ARRAY_SIZE);
-	// assert (size >= 0 && size < MAX_FILE_SIZE);
+	// assert (run != NULL);
 
-	int status = size;
 	index_node_t *inode = &sb->inodes[index];
+	int block_size = sb->geometry.block_size;
+	extent_t *extent;
+	unsigned int logical = offset / block_size, chunk_blocks, blocks;
+	block_number_t physical;
+
+	// up to the end of the inode
+	if (inode->flags & INODE_FLAG_INLINE) {
+		*run = INODE_INLINE_DATA_SIZE - offset;
+		return inode->data + offset;
+	}
 
-	// allocate the first block
-	if (inode->location.direct[0] == NULL && size != 0) {
-		inode->location.direct[0] == fs_allocate_block (sb->fs);
+	// up to the end of the block
+	if (!(inode->flags & INODE_FLAG_EXTENTS)) {
+		*run = block_size - offset % block_size;
+		return loc_locate (sb, &inode->location, offset);
 	}
 
-	// within the same block
-	if ((size - 1) / BLOCK_SIZE_IN_B == (inode->size - 1) / BLOCK_SIZE_IN_B) {
-		inode->size = size;
-		return size;
+	// up to the end of the extent
+	extent = ext_lookup (sb, &inode->extents, logical);
+	if (extent == NULL) {
+		*run = block_size - offset % block_size;
+		return NULL;
 	}
 
-	// do real resize
+	// a chunk of the device is contiguous, the next one is not
+	physical = extent->physical + logical - extent->logical;
+	chunk_blocks = sb->fs->device.chunk_blocks;
+	blocks = extent->logical + extent->length - logical;
+	if (blocks > chunk_blocks - physical % chunk_blocks)
+		blocks = chunk_blocks - physical % chunk_blocks;
+
+	*run = (long long)blocks * block_size - offset % block_size;
+	return (char *)fs_free_block_number_to_addr (sb->fs, physical) + offset % block_size;
+}
+
+// the largest size the mapping of an inode can address
+long long inode_max_size (super_block_t *sb, int index) {
+	// extents are not bound by the location object limits
+	if (sb->inodes[index].flags & INODE_FLAG_EXTENTS)
+		return sb->geometry.max_extent_file_size;
+
+	return sb->geometry.max_file_size;
+}
+
+long long inode_resize (super_block_t *sb, int index, long long size) {
+	// assert (sb != NULL);
+	// assert (index >=0 && index < sb->geometry.nr_of_inodes);
+	// assert (size >= 0 && size < sb->geometry.max_file_size);
+
+	long long status = size;
+
 	if (size < sb->inodes[index].size) 
 		status = inode_shrink (sb, index, size);
 	
@@ -699,373 +1557,1581 @@ int inode_resize (super_block_t *sb, int index, int size) {
 	return status;
 }
 
-int inode_shrink (super_block_t	*sb, int index, int size) {
+long long inode_shrink (super_block_t	*sb, int index, long long size) {
 	// assert (sb != NULL);
-	// assert (index >=0 && index < INODE_ARRAY_SIZE);
+	// assert (index >=0 && index < sb->geometry.nr_of_inodes);
 	// assert (size >= 0);
 
 	index_node_t *inode = &sb->inodes[index];
 	// assert (size < inode->size);
 
-	// within the same block
-	if ((size - 1) / BLOCK_SIZE_IN_B == (inode->size - 1) / BLOCK_SIZE_IN_B) {
-		inode->size = size;
+	// nothing to free
+	if (inode->flags & INODE_FLAG_INLINE) {
+		inode_set_size (sb, index, size);
 		return size;
 	}
 
-	location_t *location = &inode->location;
-	location_index_t location_index;
+	// keep the block holding the last byte, free everything after it
+	int block_size = sb->geometry.block_size;
+	long long from = (size + block_size - 1) / block_size * block_size;
+	if (inode->flags & INODE_FLAG_EXTENTS)
+		ext_truncate (sb, &inode->extents, from / block_size);
+	else
+		loc_truncate (sb, &inode->location, from, -1);
 
-	// current_offset offset, init to the next block
-	int current_offset = ((size - 1) / BLOCK_SIZE_IN_B + 1) * BLOCK_SIZE_IN_B;
+	inode_set_size (sb, index, size);
+
+#ifdef FS_INLINE_DATA
+	// every block is gone and the mapping is all zero, start over inline
 	if (size == 0)
-		current_offset = 0;
+		inode->flags |= INODE_FLAG_INLINE;
+#endif
 
-	while (current_offset < LOC_LIMIT_DOUBLE_INDIRECT) {
+ 	return size;
+} 
 
-		loc_index (location, current_offset, &location_index);
+// free the blocks of an inode being removed
+int inode_release (super_block_t *sb, int index) {
+	// assert (sb != NULL);
 
-		// not allocated, no need to shrink any more
-		if (loc_locate (location, current_offset) == NULL)
-			break;
+	index_node_t *inode = &sb->inodes[index];
 
-		// 1 level shrink
-		if (current_offset < LOC_LIMIT_DIRECT) {
-			inode_shrink_1_level (sb, &location->direct[location_index.level_1]);
-			current_offset += BLOCK_SIZE_IN_B;
-			continue;
-		}
+#ifdef FS_DEFERRED_RECLAIM
+	// large files are detached and handed to the reclaimer, the caller does not wait
+	if (inode->size > (long long)RECLAIM_ASYNC_THRESHOLD_IN_KB * 1024 && fs_reclaim_queue (sb->fs, inode) == 0) {
+		memset (inode->data, 0, INODE_INLINE_DATA_SIZE);	// the whole block map, whichever it is
+		inode_set_size (sb, index, 0);
+		return 0;
+	}
+#endif
 
-		// 2 level shrink
-		if (current_offset < LOC_LIMIT_SINGLE_INDIRECT) {
-			void **p = (void **)location->single_indirect[location_index.level_1];
-			p += location_index.level_2;
-			inode_shrink_1_level (sb, p);
-
-			// check to free pointer block after freeing the 64th pointer
-			if (location_index.level_2 == LOC_POINTER_PER_BLOCK - 1) {
-				p = (void **)location->single_indirect[location_index.level_1];
-				if (*p == NULL)
-					inode_shrink_1_level (sb, &location->single_indirect[location_index.level_1]);
-			}
+	return inode_shrink (sb, index, 0);
+}
 
-			current_offset += BLOCK_SIZE_IN_B;
-			continue;
+// free what *p maps at offsets from on. base is the first offset under *p and span
+// the bytes it covers, depth 0 is a data block. an index block goes once nothing
+// under it is left. returns 0 when the budget ran out first
+static int loc_truncate_tree (super_block_t *sb, block_number_t *p, int depth, long long base, long long span, long long from, int *budget) {
+	int i, pointer_per_block = sb->geometry.pointer_per_block;
+
+	// nothing there, or entirely before from
+	if (*p == LOC_NO_BLOCK || base + span <= from)
+		return 1;
+
+	if (depth > 0) {
+		for (i = 0; i < pointer_per_block; i++) {
+			if (!loc_truncate_tree (sb, (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + i, depth - 1, base + i * (span / pointer_per_block), span / pointer_per_block, from, budget))
+				return 0;
 		}
+	}
 
-		// three level shrink
-		if (current_offset < LOC_LIMIT_DOUBLE_INDIRECT) {
-			void **p = (void **)location->double_indirect[location_index.level_1];
-			p += location_index.level_2;
+	// still maps offsets before from
+	if (base < from)
+		return 1;
 
-			void **q = (void **)*p + location_index.level_3;
-			inode_shrink_1_level (sb, q);
+	if (*budget == 0)
+		return 0;
+	if (*budget > 0)
+		(*budget)--;
 
-			// check to free level-2 pointer block
-			if (location_index.level_3 == LOC_POINTER_PER_BLOCK - 1) {
-				q = (void **)*p;
-				if (*q == NULL)
-					inode_shrink_1_level (sb, p);
-			}
+	inode_shrink_1_level (sb, p);
+	return 1;
+}
 
-			// check to free level-1 pointer block
-			if (location_index.level_2 == LOC_POINTER_PER_BLOCK - 1) {
-				p = (void **)location->double_indirect[location_index.level_1];
-				if (*p == NULL)
-					inode_shrink_1_level (sb, &location->double_indirect[location_index.level_1]);
-			}
+// free every block mapping offsets from on, at most budget blocks (-1 for no limit).
+// returns 1 once done, 0 if it has to be called again
+int loc_truncate (super_block_t *sb, location_t *location, long long from, int budget) {
+	geometry_t *geometry = &sb->geometry;
+	int i;
 
-		}
+	for (i = 0; i < LOC_NR_OF_DIRECT; i++) {
+		if (!loc_truncate_tree (sb, &location->direct[i], 0, i * geometry->size_1_level, geometry->size_1_level, from, &budget))
+			return 0;
 	}
 
-	inode->size = size;
+	for (i = 0; i < LOC_NR_OF_SINGLE_INDIRECT; i++) {
+		if (!loc_truncate_tree (sb, &location->single_indirect[i], 1, geometry->limit_direct + i * geometry->size_2_level, geometry->size_2_level, from, &budget))
+			return 0;
+	}
 
- 	return size;
-} 
+	for (i = 0; i < LOC_NR_OF_DOUBLE_INDIRECT; i++) {
+		if (!loc_truncate_tree (sb, &location->double_indirect[i], 2, geometry->limit_single_indirect + i * geometry->size_3_level, geometry->size_3_level, from, &budget))
+			return 0;
+	}
+
+	for (i = 0; i < LOC_NR_OF_TRIPLE_INDIRECT; i++) {
+		if (!loc_truncate_tree (sb, &location->triple_indirect[i], 3, geometry->limit_double_indirect + i * geometry->size_4_level, geometry->size_4_level, from, &budget))
+			return 0;
+	}
 
-int inode_shrink_1_level (super_block_t *sb, void **p) {
-	void *block = *p;
-	fs_free_block (sb->fs, fs_addr_to_free_block_number (sb->fs, block));
-	*p = NULL;
+	return 1;
+}
+
+int inode_shrink_1_level (super_block_t *sb, block_number_t *p) {
+	fs_free_block (sb->fs, *p);
+	*p = LOC_NO_BLOCK;
 
 	return 0;
 }
 
 
-// expend an inode to a given size
-int inode_expand (super_block_t *sb, int index, int size) {
+// expend an inode to a given size, the new range is a hole
+long long inode_expand (super_block_t *sb, int index, long long size) {
 	// assert (sb != NULL);
-	// assert (index >=0 && index < INODE_ARRAY_SIZE);
-	// assert (size <= MAX_FILE_SIZE);
-
-	// no free blocks;
-	if (sb->free_blocks == 0)
-		return -1;
+	// assert (index >=0 && index < sb->geometry.nr_of_inodes);
+	// assert (size <= inode_max_size (sb, index));
 
 	// get inode
 	index_node_t *inode = &sb->inodes[index];
 	// assert (size > inode->size);
 
-	// allocate the first block
-	if (inode->location.direct[0] == NULL && size != 0) {
-		inode->location.direct[0] = fs_allocate_block (sb->fs);
-	}
+	int block_size = sb->geometry.block_size;
+	long long end;
 
-	// the offset is within the same block, no need to expand
-	if ((size - 1) / BLOCK_SIZE_IN_B == (inode->size - 1) / BLOCK_SIZE_IN_B) {
-		inode->size = size;
-		return size;
+	// still fits in the inode, the bytes past the old size may be stale
+	if (inode->flags & INODE_FLAG_INLINE) {
+		if (size <= INODE_INLINE_DATA_SIZE) {
+			memset (inode->data + inode->size, 0, size - inode->size);
+			inode_set_size (sb, index, size);
+			return size;
+		}
+		if (inode_uninline (sb, index) < 0)
+			return -1;
 	}
 
-	location_t *location = &inode->location;
+	// blocks are not zeroed on allocation, clear the rest of the last one
+	end = (inode->size + block_size - 1) / block_size * block_size;
+	end = end < size ? end : size;
+	if (end > inode->size)
+		inode_zero (sb, index, inode->size, end - inode->size);
 
-	// allocation counter
-	int current_offset = 0;
+	inode_set_size (sb, index, size);
 
-	location_index_t location_index;
-	void *p = NULL, *status = NULL;
-
-	// traverse and allocate all
-	while (current_offset < size) {
+	return size;
+}
 
-		// get current_offset allocation index
-		loc_index (location, current_offset, &location_index);
+// a hole, 1 if the block is one, -1 if an index block on the way can't be allocated.
+// slot is where a location object maps it
+static int inode_hole (super_block_t *sb, index_node_t *inode, long long block, block_number_t **slot) {
+	if (inode->flags & INODE_FLAG_EXTENTS)
+		return ext_lookup (sb, &inode->extents, block) == NULL;
 
-		// one level allocation
-		if (current_offset < LOC_LIMIT_DIRECT) {
+	*slot = loc_slot (sb, &inode->location, block * sb->geometry.block_size);
+	if (*slot == NULL)
+		return -1;
 
-			// allocate data block
-			if (loc_locate (location, current_offset) == NULL) {
-				status = fs_allocate_block (sb->fs);
-				// assert (status != NULL);
+	return **slot == LOC_NO_BLOCK;
+}
 
-				location->direct[location_index.level_1] = status;
-			}
-			
-			current_offset += BLOCK_SIZE_IN_B;
-			continue;
-		}
+// back the bytes from offset to offset + len with blocks, filling holes only. a new block
+// is zeroed where it lies inside the size but outside the range, the range is written next
+long long inode_map (super_block_t *sb, int index, long long offset, long long len) {
+	// assert (sb != NULL);
+	// assert (!(sb->inodes[index].flags & INODE_FLAG_INLINE));
 
-		// two level allocation
-		if (current_offset < LOC_LIMIT_SINGLE_INDIRECT) {
-
-			if (loc_locate (location, current_offset) == NULL) {
-				
-				// level 1 allocation
-				p = location->single_indirect[location_index.level_1];
-				if (p == NULL) {
-					status = fs_allocate_block (sb->fs);
-					// assert (status != NULL);
-					location->single_indirect[location_index.level_1] = fs_allocate_block (sb->fs);
-				}
-
-				// data block allocation
-				p = location->single_indirect[location_index.level_1];
-				p = (void *)((void**)p + location_index.level_2);
-				if (*(void **)p == NULL)
-					*(void **)p = fs_allocate_block (sb->fs);
-			}
+	index_node_t *inode = &sb->inodes[index];
+	int block_size = sb->geometry.block_size;
+	long long block, start, missing = 0;
+	long long first = offset / block_size, last = (offset + len - 1) / block_size;
 
-			current_offset += BLOCK_SIZE_IN_B;
-			continue;
-		}
+	block_number_t pool[INODE_EXPAND_BATCH], *slot, physical;
+	void *data;
+	int count = 0, taken = 0, hole;
 
-		// three level allocation
-		if (current_offset < LOC_LIMIT_DOUBLE_INDIRECT) {
-
-			if (loc_locate (location, current_offset) == NULL) {
-				
-				// level 1 allocation
-				p = location->double_indirect[location_index.level_1];
-				if (p == NULL) {
-					p = fs_allocate_block (sb->fs);
-					// assert (p != NULL);
-					location->double_indirect[location_index.level_1] = p;
-				}
-
-				// level 2 allocation
-				p = (void *)((void **)p + location_index.level_2);
-				if (*(void **)p == NULL) {
-					*(void **)p = fs_allocate_block (sb->fs);
-				}
-
-				// data block allocation
-				p = *(void **)p;
-				p = (void *)((void **)p + location_index.level_3);
-				if (*(void **)p == NULL)
-					*(void **)p = fs_allocate_block (sb->fs);
-			}
+	if (len == 0)
+		return 0;
 
-			current_offset += BLOCK_SIZE_IN_B;
-			continue;
-		}  
+	// first pass: allocate index blocks, count the holes
+	for (block = first; block <= last; block++) {
+		hole = inode_hole (sb, inode, block, &slot);
+		if (hole < 0)
+			goto fail;
 
-		// assert (0);
+		missing += hole;
 	}
 
-	inode->size = size;
-
-	return size;
-}
-
-// allocate a block, init with all zero
-void *fs_allocate_block (fs_t *fs) {
-	// assert (fs != NULL);
+	// second pass: data blocks, reserved in contiguous runs so they land next to each other
+	for (block = first; block <= last && missing > 0; block++) {
+		if (!inode_hole (sb, inode, block, &slot))
+			continue;
 
-	// can't allocate
-	if (fs->super_block->free_blocks == 0)
-		return NULL;
+		// refill the pool
+		if (taken == count) {
+			count = fs_allocate_blocks (sb->fs, missing < INODE_EXPAND_BATCH ? missing : INODE_EXPAND_BATCH, pool);
+			taken = 0;
+			if (count == 0)
+				goto fail;
+		}
 
-	// compute and get a free block
-	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
-	int block = bitmap_ops->first_free (bitmap_ops);
+		// extents merge with the one before when contiguous
+		physical = pool[taken];
+		data = fs_free_block_number_to_addr (sb->fs, physical);
+		if (inode->flags & INODE_FLAG_EXTENTS) {
+			if (ext_insert (sb, &inode->extents, block, physical, 1) < 0)
+				goto fail;
+		}
+		else
+			*slot = physical;
+		taken++;
+		missing--;
+
+		// filling a hole, or the part ahead of the range in the new last block
+		start = block * block_size;
+		if (start < inode->size)
+			memset (data, 0, block_size);
+		else if (start < offset)
+			memset (data, 0, offset - start);
+	}
 
-	// set bitmap
-	bitmap_ops->set (bitmap_ops, block);
-	// update counter
-	fs->super_block->free_blocks--;
+	return len;
 
-	// init with zero
-	memset (fs->device.locate (&fs->device, OFFSET_FREE_BLOCK + block), 0, BLOCK_SIZE_IN_B);
+fail:
+	// the unused blocks, and the ones mapped past the end
+	while (taken < count)
+		fs_free_block (sb->fs, pool[taken++]);
+	inode_shrink (sb, index, inode->size);
 
-	return fs->device.locate (&fs->device, OFFSET_FREE_BLOCK + block);
+	return -1;
 }
 
-// free an allocated block, erase its content
-int fs_free_block (fs_t *fs, int free_block_number) {
-	// assert (fs != NULL);
-	// assert (free_block_number >= 0 && free_block_number < OFFSET_LIMIT - OFFSET_FREE_BLOCK);
-
-	// clear bitmap
-	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
-	bitmap_ops->clear (bitmap_ops, free_block_number);
+// move inline data out to blocks
+int inode_uninline (super_block_t *sb, int index) {
+	// assert (sb != NULL);
+	// assert (sb->inodes[index].flags & INODE_FLAG_INLINE);
 
-	// erase
-	memset (fs->device.locate (&fs->device, OFFSET_FREE_BLOCK + free_block_number), 0, BLOCK_SIZE_IN_B);
+	index_node_t *inode = &sb->inodes[index];
+	unsigned char data[INODE_INLINE_DATA_SIZE];
+	int old_size = inode->size;
+
+	// the data area turns into an empty mapping
+	memcpy (data, inode->data, old_size);
+	memset (inode->data, 0, INODE_INLINE_DATA_SIZE);
+	inode->flags &= ~INODE_FLAG_INLINE;
+
+	// out of space, back the way it was
+	if (inode_map (sb, index, 0, old_size) < 0) {
+		inode_shrink (sb, index, 0);
+		memset (inode->data, 0, INODE_INLINE_DATA_SIZE);
+		memcpy (inode->data, data, old_size);
+		inode->flags |= INODE_FLAG_INLINE;
+		inode_set_size (sb, index, old_size);
+		return -1;
+	}
 
-	// update counter
-	fs->super_block->free_blocks++;
+	inode_write (sb, index, 0, data, old_size);
 
 	return 0;
 }
 
-int fs_addr_to_free_block_number (fs_t *fs, void *free_block_addr) {
-	return (free_block_addr - fs->super_block->blocks) / BLOCK_SIZE_IN_B;
-}
+// allocate an index block for an empty slot, 0 if out of space
+static block_number_t loc_slot_fill (super_block_t *sb, block_number_t *p) {
+	if (*p == LOC_NO_BLOCK)
+		*p = fs_allocate_block (sb->fs);
 
-void* fs_abs_block_number_to_addr (fs_t *fs, int abs_block_number) {
-	return fs->device.locate (&fs->device, abs_block_number);
+	return *p;
 }
 
-void* device_locate (device_t *device, int absolute_block_number) {
-	return (void *)((char *)device->start + absolute_block_number * BLOCK_SIZE_IN_B);
-}
+// find the slot of the data block at offset, allocating index blocks on the way
+block_number_t* loc_slot (super_block_t *sb, location_t *location, long long offset) {
+	// assert (offset >= 0 && offset < sb->geometry.limit_triple_indirect);
 
+	location_index_t index;
+	block_number_t *p;
 
-// locate the offset according to location object
-void* loc_locate (location_t *location, int offset) {
+	loc_index (&sb->geometry, location, offset, &index);
 
-	// assert (location != NULL);
-	// assert (offset >= 0 && offset < LOC_LIMIT_DOUBLE_INDIRECT);
+	// one level
+	if (offset < sb->geometry.limit_direct)
+		return &location->direct[index.level_1];
 
-	location_index_t index;
+	// two level
+	if (offset < sb->geometry.limit_single_indirect) {
+		p = &location->single_indirect[index.level_1];
+		if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+			return NULL;
 
-	// get the index first
-	loc_index (location, offset, &index);
-	void *p = NULL;
+		return (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_2;
+	}
+
+	// three level
+	if (offset < sb->geometry.limit_double_indirect) {
+		p = &location->double_indirect[index.level_1];
+		if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+			return NULL;
+
+		p = (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_2;
+		if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+			return NULL;
+
+		return (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_3;
+	}
+
+	// four level
+	p = &location->triple_indirect[index.level_1];
+	if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+		return NULL;
+
+	p = (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_2;
+	if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+		return NULL;
+
+	p = (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_3;
+	if (loc_slot_fill (sb, p) == LOC_NO_BLOCK)
+		return NULL;
+
+	return (block_number_t *)fs_free_block_number_to_addr (sb->fs, *p) + index.level_4;
+}
+
+// an extent block, or the root in the inode
+static extent_header_t* ext_node (super_block_t *sb, unsigned int block) {
+	return (extent_header_t *)fs_free_block_number_to_addr (sb->fs, block);
+}
+
+static extent_t* ext_entries (extent_header_t *node) {
+	return (extent_t *)(node + 1);
+}
+
+static int ext_capacity (super_block_t *sb, extent_root_t *root, extent_header_t *node) {
+	return node == &root->header ? EXTENT_NR_OF_INLINE : sb->geometry.extents_per_block;
+}
+
+// last entry of a node starting at or before logical, NULL if there is none
+static extent_t* ext_search (extent_header_t *node, unsigned int logical) {
+	extent_t *entries = ext_entries (node);
+	int low = 0, high = node->count - 1, middle;
+
+	if (node->count == 0 || entries[0].logical > logical)
+		return NULL;
+
+	while (low < high) {
+		middle = (low + high + 1) / 2;
+		if (entries[middle].logical <= logical)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	return &entries[low];
+}
+
+// the extent mapping a logical block, NULL if it is not mapped
+extent_t* ext_lookup (super_block_t *sb, extent_root_t *root, unsigned int logical) {
+	// assert (sb != NULL);
+	// assert (root != NULL);
+
+	extent_header_t *node = &root->header;
+	extent_t *extent;
+
+	for (;;) {
+		extent = ext_search (node, logical);
+		if (extent == NULL)
+			return NULL;
+
+		if (node->depth == 0)
+			break;
+
+		node = ext_node (sb, extent->physical);
+	}
+
+	if (logical >= extent->logical + extent->length)
+		return NULL;
+
+	return extent;
+}
+
+// put an entry at pos in a node with room
+static void ext_insert_at (extent_header_t *node, int pos, extent_t *entry) {
+	extent_t *entries = ext_entries (node);
+
+	memmove (&entries[pos + 1], &entries[pos], (node->count - pos) * sizeof (extent_t));
+	entries[pos] = *entry;
+	node->count++;
+}
+
+// map a run of blocks over a hole. it merges into the extent before it when both
+// runs are contiguous, otherwise full nodes on the way up split, the root moves down
+int ext_insert (super_block_t *sb, extent_root_t *root, unsigned int logical, block_number_t physical, unsigned int length) {
+	// assert (sb != NULL);
+	// assert (root != NULL);
+	// assert (length > 0);
+
+	extent_header_t *path[EXTENT_MAX_DEPTH + 2], *node = &root->header, *child;
+	int slots[EXTENT_MAX_DEPTH + 2];
+	block_number_t blocks[EXTENT_MAX_DEPTH + 2];
+	extent_t *entries, *extent, entry;
+	int depth = root->header.depth, level, pos, split, i, needed;
+
+	// down to the leaf, keeping the entry taken at every level
+	for (;;) {
+		path[node->depth] = node;
+		entries = ext_entries (node);
+		extent = ext_search (node, logical);
+		if (node->depth == 0)
+			break;
+
+		// before the first child, which now starts here
+		if (extent == NULL) {
+			extent = &entries[0];
+			extent->logical = logical;
+		}
+		slots[node->depth] = extent - entries;
+		node = ext_node (sb, extent->physical);
+	}
+	pos = extent == NULL ? 0 : extent - entries + 1;
+
+	// grow the extent before
+	if (extent != NULL && extent->logical + extent->length == logical && extent->physical + extent->length == physical) {
+		extent->length += length;
+		return 0;
+	}
+
+	// lowest node on the path with room, every full one below it splits
+	for (level = 0; level <= depth; level++) {
+		if (path[level]->count < ext_capacity (sb, root, path[level]))
+			break;
+	}
+
+	// and when even the root is full, one block to move it down into
+	needed = level > depth ? level + 1 : level;
+	if (level > depth && depth == EXTENT_MAX_DEPTH)
+		return -1;
+
+	for (i = 0; i < needed; i++) {
+		blocks[i] = fs_allocate_block (sb->fs);
+		if (blocks[i] == LOC_NO_BLOCK) {
+			while (i-- > 0)
+				fs_free_block (sb->fs, blocks[i]);
+			return -1;
+		}
+	}
+
+	entry.logical = logical;
+	entry.physical = physical;
+	entry.length = length;
+
+	for (level = 0; ; ) {
+		node = path[level];
+		if (node->count < ext_capacity (sb, root, node)) {
+			ext_insert_at (node, pos, &entry);
+			break;
+		}
+
+		// move the root down, the root points to it alone
+		if (node == &root->header) {
+			child = ext_node (sb, blocks[--needed]);
+			memcpy (child, root, sizeof (extent_header_t) + root->header.count * sizeof (extent_t));
+
+			root->header.depth++;
+			root->header.count = 1;
+			root->extents[0].logical = pos == 0 ? entry.logical : ext_entries (child)[0].logical;
+			root->extents[0].physical = blocks[needed];
+			root->extents[0].length = 0;
+
+			path[level] = child;
+			path[level + 1] = &root->header;
+			slots[level + 1] = 0;
+			continue;
+		}
+
+		// split, appending leaves the left node full
+		child = ext_node (sb, blocks[--needed]);
+		split = pos == node->count ? node->count : node->count / 2;
+		child->depth = node->depth;
+		child->count = node->count - split;
+		memcpy (ext_entries (child), ext_entries (node) + split, child->count * sizeof (extent_t));
+		node->count = split;
+
+		if (pos >= split)
+			ext_insert_at (child, pos - split, &entry);
+		else
+			ext_insert_at (node, pos, &entry);
+
+		// the parent points to the new node right after this one
+		entry.logical = ext_entries (child)[0].logical;
+		entry.physical = blocks[needed];
+		entry.length = 0;
+
+		level++;
+		pos = slots[level] + 1;
+	}
+
+	// a moved root did not need to split
+	while (needed > 0)
+		fs_free_block (sb->fs, blocks[--needed]);
+
+	return 0;
+}
+
+// unmap and free the blocks of a node from logical block from on, and the nodes left empty
+static void ext_truncate_node (super_block_t *sb, extent_header_t *node, unsigned int from) {
+	extent_t *entries = ext_entries (node);
+	extent_header_t *child;
+	int i;
+
+	for (i = node->count - 1; i >= 0; i--) {
+		// a subtree, it stays if it still maps anything before from
+		if (node->depth > 0) {
+			child = ext_node (sb, entries[i].physical);
+			ext_truncate_node (sb, child, from);
+			if (child->count > 0)
+				break;
+
+			fs_free_block (sb->fs, entries[i].physical);
+			node->count--;
+			continue;
+		}
+
+		// entirely past from
+		if (entries[i].logical >= from) {
+			fs_free_blocks (sb->fs, entries[i].physical, entries[i].length);
+			node->count--;
+			continue;
+		}
+
+		// its tail is past from
+		if (entries[i].logical + entries[i].length > from) {
+			fs_free_blocks (sb->fs, entries[i].physical + from - entries[i].logical, entries[i].logical + entries[i].length - from);
+			entries[i].length = from - entries[i].logical;
+		}
+		break;
+	}
+}
+
+// free every block from logical block from on
+int ext_truncate (super_block_t *sb, extent_root_t *root, unsigned int from) {
+	// assert (sb != NULL);
+	// assert (root != NULL);
+
+	ext_truncate_node (sb, &root->header, from);
+
+	if (root->header.count == 0)
+		root->header.depth = 0;
+
+	return 0;
+}
+
+#ifndef _KERNEL_MODE
+// threads are spread over the magazines in the order they first allocate
+int fs_cpu_id () {
+	static int next = 0;
+	static __thread int id = -1;
+
+	if (id < 0)
+		id = __sync_fetch_and_add (&next, 1) % FS_NR_OF_CPUS;
+
+	return id;
+}
+#endif
+
+int fs_count_free_blocks (fs_t *fs) {
+	block_allocator_t *allocator = fs->super_block->allocator;
+	int i, sum = 0;
+
+	for (i = 0; i < FS_NR_OF_CPUS; i++)
+		sum += allocator->magazines[i].free_blocks;
+
+	return sum;
+}
+
+// reserve a run of up to n free blocks in the bitmap, bitmap lock held
+static int fs_reserve_run (fs_t *fs, int n, int *first) {
+	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
+	int block, run = 0;
+
+	// start of the run
+	block = bitmap_ops->first_free (bitmap_ops);
+	if (block < 0)
+		return 0;
+
+	// extend it over the free blocks that follow
+	while (run < n && block + run < bitmap_ops->nr_of_bits && !bitmap_ops->test (bitmap_ops, block + run)) {
+		bitmap_ops->set (bitmap_ops, block + run);
+		run++;
+	}
+	bitmap_ops->cursor = block + run;
+
+	*first = block;
+	return run;
+}
+
+// give half of a magazine back to the bitmap, magazine lock held
+static void fs_magazine_drain (fs_t *fs, block_magazine_t *magazine, int keep) {
+	block_allocator_t *allocator = fs->super_block->allocator;
+	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
+
+	fs_lock (&allocator->lock);
+	while (magazine->count > keep)
+		bitmap_ops->clear (bitmap_ops, magazine->blocks[--magazine->count]);
+	fs_unlock (&allocator->lock);
+}
+
+// fill a magazine with one run from the bitmap, magazine lock held
+static int fs_magazine_refill (fs_t *fs, block_magazine_t *magazine) {
+	block_allocator_t *allocator = fs->super_block->allocator;
+	int first, run;
+
+	fs_lock (&allocator->lock);
+	run = fs_reserve_run (fs, BLOCK_MAGAZINE_BATCH, &first);
+	fs_unlock (&allocator->lock);
+
+	// popped from the top, so store the run backwards
+	while (run > 0)
+		magazine->blocks[magazine->count++] = first + --run;
+
+	return magazine->count;
+}
+
+// the bitmap ran dry, give back what the other cpus cached
+static void fs_magazine_drain_all (fs_t *fs) {
+	block_allocator_t *allocator = fs->super_block->allocator;
+	int i;
+
+	for (i = 0; i < FS_NR_OF_CPUS; i++) {
+		fs_lock (&allocator->magazines[i].lock);
+		fs_magazine_drain (fs, &allocator->magazines[i], 0);
+		fs_unlock (&allocator->magazines[i].lock);
+	}
+}
+
+// allocate an index block, init with all zero. LOC_NO_BLOCK if out of space
+block_number_t fs_allocate_block (fs_t *fs) {
+	// assert (fs != NULL);
+
+	block_magazine_t *magazine = &fs->super_block->allocator->magazines[fs_cpu_id ()];
+	int block, drained = 0;
+	void *addr;
+
+	// get a free block from this cpu's magazine, refill it from the bitmap when empty
+	for (;;) {
+		fs_lock (&magazine->lock);
+		if (magazine->count > 0 || fs_magazine_refill (fs, magazine) > 0)
+			break;
+		fs_unlock (&magazine->lock);
+
+		// pull back what the other cpus cached, then what waits to be reclaimed
+		if (!drained) {
+			fs_magazine_drain_all (fs);
+			drained = 1;
+			continue;
+		}
+
+		// can't allocate
+		if (!fs_reclaim_help (fs))
+			return LOC_NO_BLOCK;
+		drained = 0;
+	}
+
+	block = magazine->blocks[--magazine->count];
+	// update counter
+	magazine->free_blocks--;
+	fs_unlock (&magazine->lock);
+
+	// no memory for its chunk, back into the magazine
+	addr = device_take (&fs->device, fs->super_block->geometry.offset_free_block + block);
+	if (addr == NULL) {
+		fs_lock (&magazine->lock);
+		if (magazine->count == BLOCK_MAGAZINE_SIZE)
+			fs_magazine_drain (fs, magazine, BLOCK_MAGAZINE_SIZE - BLOCK_MAGAZINE_BATCH);
+		magazine->blocks[magazine->count++] = block;
+		magazine->free_blocks++;
+		fs_unlock (&magazine->lock);
+		return LOC_NO_BLOCK;
+	}
+
+	// init with zero
+	memset (addr, 0, fs->device.block_size);
+
+	return block;
+}
+
+// allocate up to n data blocks in as few contiguous runs as possible.
+// unlike fs_allocate_block, the content is not zeroed: nothing past an
+// inode's size is ever read, and inode_map zeroes what a write leaves out
+int fs_allocate_blocks (fs_t *fs, int n, block_number_t *out) {
+	// assert (fs != NULL);
+	// assert (out != NULL);
+
+	block_allocator_t *allocator = fs->super_block->allocator;
+	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
+	block_magazine_t *magazine;
+	int count = 0, drained = 0, block, run, i;
+
+	while (count < n) {
+		// bulk requests go straight to the bitmap
+		fs_lock (&allocator->lock);
+		run = fs_reserve_run (fs, n - count, &block);
+		fs_unlock (&allocator->lock);
+
+		// pull back what the other cpus cached, then what waits to be reclaimed
+		if (run == 0) {
+			if (!drained) {
+				fs_magazine_drain_all (fs);
+				drained = 1;
+				continue;
+			}
+			if (!fs_reclaim_help (fs))
+				break;
+			drained = 0;
+			continue;
+		}
+
+		for (i = 0; i < run; i++) {
+			if (device_take (&fs->device, fs->super_block->geometry.offset_free_block + block + i) == NULL)
+				break;
+			out[count++] = block + i;
+		}
+
+		// no memory for a chunk, the rest of the run goes back
+		if (i < run) {
+			fs_lock (&allocator->lock);
+			while (i < run)
+				bitmap_ops->clear (bitmap_ops, block + i++);
+			fs_unlock (&allocator->lock);
+			break;
+		}
+	}
+
+	// update counter
+	magazine = &allocator->magazines[fs_cpu_id ()];
+	fs_lock (&magazine->lock);
+	magazine->free_blocks -= count;
+	fs_unlock (&magazine->lock);
+
+	return count;
+}
+
+// free an allocated block, its content is left as is unless FS_SECURE_ERASE
+int fs_free_block (fs_t *fs, int free_block_number) {
+	// assert (fs != NULL);
+	// assert (free_block_number >= 0 && free_block_number < fs->super_block->bitmap_ops.nr_of_bits);
+
+	block_magazine_t *magazine = &fs->super_block->allocator->magazines[fs_cpu_id ()];
+
+#ifdef FS_SECURE_ERASE
+	// erase
+	memset (fs->device.locate (&fs->device, fs->super_block->geometry.offset_free_block + free_block_number), 0, fs->device.block_size);
+#endif
+
+	// its chunk goes away with the last block in use
+	device_put (&fs->device, fs->super_block->geometry.offset_free_block + free_block_number, 1);
+
+	// cache it in this cpu's magazine, the bitmap bit stays set until the magazine drains
+	fs_lock (&magazine->lock);
+	if (magazine->count == BLOCK_MAGAZINE_SIZE)
+		fs_magazine_drain (fs, magazine, BLOCK_MAGAZINE_SIZE - BLOCK_MAGAZINE_BATCH);
+	magazine->blocks[magazine->count++] = free_block_number;
+
+	// update counter
+	magazine->free_blocks++;
+	fs_unlock (&magazine->lock);
+
+	return 0;
+}
+
+// free a run of n blocks, straight back into the bitmap
+int fs_free_blocks (fs_t *fs, int first, int n) {
+	// assert (fs != NULL);
+	// assert (first >= 0 && first + n <= fs->super_block->bitmap_ops.nr_of_bits);
+
+	block_allocator_t *allocator = fs->super_block->allocator;
+	bitmap_ops_t *bitmap_ops = &fs->super_block->bitmap_ops;
+	block_magazine_t *magazine;
+	int i;
+
+#ifdef FS_SECURE_ERASE
+	// erase
+	for (i = 0; i < n; i++)
+		memset (fs->device.locate (&fs->device, fs->super_block->geometry.offset_free_block + first + i), 0, fs->device.block_size);
+#endif
+	device_put (&fs->device, fs->super_block->geometry.offset_free_block + first, n);
+
+	fs_lock (&allocator->lock);
+	for (i = 0; i < n; i++)
+		bitmap_ops->clear (bitmap_ops, first + i);
+	fs_unlock (&allocator->lock);
+
+	// update counter
+	magazine = &allocator->magazines[fs_cpu_id ()];
+	fs_lock (&magazine->lock);
+	magazine->free_blocks += n;
+	fs_unlock (&magazine->lock);
+
+	return n;
+}
+
+#ifndef _KERNEL_MODE
+// the whole pages in the free blocks of a chunk go back to the host, bitmap lock held
+static long long fs_release_pages (fs_t *fs, unsigned int chunk) {
+	device_t *device = &fs->device;
+	bitmap_word_t *words = fs->super_block->bitmap_ops.levels[0];
+	unsigned int base = chunk * device->chunk_blocks, block = base, start;
+	unsigned int end = base + device_chunk_size (device, chunk) / device->block_size;
+	unsigned long page = device_page_size (device->chunk_memory[chunk]);
+	unsigned long first, last;
+	long long released = 0;
+
+	while (block < end) {
+		// skip the blocks in use, a word at a time
+		if (block % BITMAP_BITS_PER_WORD == 0 && words[block / BITMAP_BITS_PER_WORD] == ~(bitmap_word_t)0) {
+			block += BITMAP_BITS_PER_WORD;
+			continue;
+		}
+		if (words[block / BITMAP_BITS_PER_WORD] >> (block % BITMAP_BITS_PER_WORD) & 1) {
+			block++;
+			continue;
+		}
+
+		// a run of free blocks
+		start = block;
+		while (block < end && !(words[block / BITMAP_BITS_PER_WORD] >> (block % BITMAP_BITS_PER_WORD) & 1)) {
+			if (block % BITMAP_BITS_PER_WORD == 0 && words[block / BITMAP_BITS_PER_WORD] == 0)
+				block += BITMAP_BITS_PER_WORD;
+			else
+				block++;
+		}
+		block = block < end ? block : end;
+
+		// the pages it covers entirely, chunks are aligned to their pages
+		first = ((unsigned long)(start - base) * device->block_size + page - 1) / page * page;
+		last = (unsigned long)(block - base) * device->block_size / page * page;
+		if (first < last && madvise ((char *)device->chunks[chunk] + first, last - first, MADV_DONTNEED) == 0)
+			released += last - first;
+	}
+
+	return released;
+}
+#endif
+
+// give memory under free blocks back to the host: chunks with no block in use, and
+// in user mode the free pages of the others. the bytes released
+long long fs_release_memory (fs_t *fs) {
+	device_t *device = &fs->device;
+	long long released = 0;
+	unsigned int chunk;
+
+	device->nr_of_freed = 0;
+
+	// blocks cached by the cpus are free as well
+	fs_magazine_drain_all (fs);
+
+	for (chunk = 0; chunk < device->nr_of_chunks; chunk++) {
+		if (device->chunks[chunk] == NULL)
+			continue;
+
+#ifdef _KERNEL_MODE
+		released += device_release (device, chunk);
+#else
+		// nothing allocated from the bitmap, or released by another pass, while the pages go
+		fs_lock (&fs->super_block->allocator->lock);
+		released += device_release (device, chunk);
+		if (device->chunks[chunk] != NULL)
+			released += fs_release_pages (fs, chunk);
+		fs_unlock (&fs->super_block->allocator->lock);
+#endif
+	}
+
+	return released;
+}
+
+// once enough was freed since the last pass
+void fs_release_memory_check (fs_t *fs) {
+	if ((unsigned long long)fs->device.nr_of_freed * fs->device.block_size >= (unsigned long long)DEVICE_RELEASE_THRESHOLD_IN_KB * 1024)
+		fs_release_memory (fs);
+}
+
+// resident memory against capacity, and the inodes left
+int fs_stat (fs_t *fs, fs_stat_t *stat) {
+	device_t *device = &fs->device;
+	unsigned int chunk;
+
+	stat->block_size = device->block_size;
+	stat->capacity = (unsigned long long)device->nr_of_blocks * device->block_size;
+	stat->in_use = (unsigned long long)(device->nr_of_blocks - fs_count_free_blocks (fs)) * device->block_size;
+	stat->resident = device_resident (device);
+	stat->nr_of_chunks = device->nr_of_chunks;
+	stat->nr_of_resident_chunks = 0;
+	stat->nr_of_huge_chunks = 0;
+	stat->meta_on_huge_pages = device->meta_memory != DEVICE_MEMORY_SMALL;
+	stat->nr_of_inodes = fs->super_block->geometry.nr_of_inodes;
+	stat->free_inodes = fs->super_block->free_inodes;
+	for (chunk = 0; chunk < device->nr_of_chunks; chunk++) {
+		if (device->chunks[chunk] == NULL)
+			continue;
+		stat->nr_of_resident_chunks++;
+		stat->nr_of_huge_chunks += device->chunk_memory[chunk] != DEVICE_MEMORY_SMALL;
+	}
+
+	return 0;
+}
+
+// free one detached block map, a location tree RECLAIM_BATCH blocks at a time.
+// an extent tree goes in one pass, each extent is a single run to free.
+// returns 0 if there was nothing queued
+int fs_reclaim_run (fs_t *fs) {
+	reclaimer_t *reclaimer = fs->super_block->reclaimer;
+	reclaim_item_t item;
+
+	fs_lock (&reclaimer->lock);
+	if (reclaimer->count == 0) {
+		fs_unlock (&reclaimer->lock);
+		return 0;
+	}
+	item = reclaimer->queue[reclaimer->head];
+	reclaimer->head = (reclaimer->head + 1) % RECLAIM_QUEUE_SIZE;
+	reclaimer->count--;
+	reclaimer->running++;
+	fs_unlock (&reclaimer->lock);
+
+	if (item.flags & INODE_FLAG_EXTENTS)
+		ext_truncate (fs->super_block, &item.extents, 0);
+	else
+		while (!loc_truncate (fs->super_block, &item.location, 0, RECLAIM_BATCH))
+			fs_yield ();
+
+	fs_lock (&reclaimer->lock);
+	reclaimer->running--;
+	fs_unlock (&reclaimer->lock);
+
+	return 1;
+}
+
+// for an allocator out of blocks: free a queued block map, or give way to
+// whoever is freeing one already. returns 0 once no more blocks are coming back
+int fs_reclaim_help (fs_t *fs) {
+	reclaimer_t *reclaimer = fs->super_block->reclaimer;
+	int running;
+
+	if (fs_reclaim_run (fs))
+		return 1;
+
+	fs_lock (&reclaimer->lock);
+	running = reclaimer->running;
+	fs_unlock (&reclaimer->lock);
+
+	if (running)
+		fs_yield ();
+
+	return running;
+}
+
+#ifdef _KERNEL_MODE
+static void fs_reclaim_work (struct work_struct *work) {
+	reclaimer_t *reclaimer = container_of (work, reclaimer_t, work);
+
+	while (fs_reclaim_run (reclaimer->fs))
+		;
+	fs_release_memory_check (reclaimer->fs);
+}
+#else
+static void *fs_reclaim_thread (void *arg) {
+	reclaimer_t *reclaimer = (reclaimer_t *)arg;
+
+	fs_lock (&reclaimer->lock);
+	while (!reclaimer->stop) {
+		if (reclaimer->count == 0 || reclaimer->paused) {
+			pthread_cond_wait (&reclaimer->wakeup, &reclaimer->lock);
+			continue;
+		}
+
+		reclaimer->busy = 1;
+		fs_unlock (&reclaimer->lock);
+		fs_reclaim_run (reclaimer->fs);
+		fs_release_memory_check (reclaimer->fs);
+		fs_lock (&reclaimer->lock);
+		reclaimer->busy = 0;
+		pthread_cond_broadcast (&reclaimer->idle);
+	}
+	fs_unlock (&reclaimer->lock);
+
+	return NULL;
+}
+
+// a fork copies whatever locks the worker holds, and nobody in the child would
+// ever release them. the worker is idled before the fork, with its lock held
+// by the forking thread, and let go on both sides after
+static reclaimer_t *fs_reclaimers = NULL;
+static pthread_mutex_t fs_reclaimers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fs_reclaim_atfork_once = PTHREAD_ONCE_INIT;
+
+static void fs_reclaim_prepare (void) {
+	reclaimer_t *reclaimer;
+
+	pthread_mutex_lock (&fs_reclaimers_lock);
+	for (reclaimer = fs_reclaimers; reclaimer != NULL; reclaimer = reclaimer->next) {
+		fs_lock (&reclaimer->lock);
+		reclaimer->paused = 1;
+		while (reclaimer->busy)
+			pthread_cond_wait (&reclaimer->idle, &reclaimer->lock);
+	}
+}
+
+static void fs_reclaim_parent (void) {
+	reclaimer_t *reclaimer;
+
+	for (reclaimer = fs_reclaimers; reclaimer != NULL; reclaimer = reclaimer->next) {
+		reclaimer->paused = 0;
+		pthread_cond_signal (&reclaimer->wakeup);
+		fs_unlock (&reclaimer->lock);
+	}
+	pthread_mutex_unlock (&fs_reclaimers_lock);
+}
+
+// the worker is not copied, the next queue in the child starts its own.
+// nor is any other thread, what they were freeing never comes back here
+static void fs_reclaim_child (void) {
+	reclaimer_t *reclaimer;
+
+	for (reclaimer = fs_reclaimers; reclaimer != NULL; reclaimer = reclaimer->next) {
+		reclaimer->paused = 0;
+		reclaimer->running = 0;
+		fs_unlock (&reclaimer->lock);
+	}
+	pthread_mutex_unlock (&fs_reclaimers_lock);
+}
+
+static void fs_reclaim_atfork (void) {
+	pthread_atfork (fs_reclaim_prepare, fs_reclaim_parent, fs_reclaim_child);
+}
+#endif
+
+// hand the block map of inode to the background worker, -1 if the queue is full.
+// the caller clears it from the inode once it is queued
+int fs_reclaim_queue (fs_t *fs, index_node_t *inode) {
+	reclaimer_t *reclaimer = fs->super_block->reclaimer;
+
+	fs_lock (&reclaimer->lock);
+	if (reclaimer->count == RECLAIM_QUEUE_SIZE) {
+		fs_unlock (&reclaimer->lock);
+		return -1;
+	}
+
+#ifndef _KERNEL_MODE
+	// the worker only exists in the process that started it
+	if (reclaimer->pid != getpid ()) {
+		if (pthread_create (&reclaimer->thread, NULL, fs_reclaim_thread, reclaimer) != 0) {
+			fs_unlock (&reclaimer->lock);
+			return -1;
+		}
+		reclaimer->pid = getpid ();
+	}
+#endif
+
+	reclaim_item_t *item = &reclaimer->queue[(reclaimer->head + reclaimer->count) % RECLAIM_QUEUE_SIZE];
+	item->flags = inode->flags & INODE_FLAG_EXTENTS;
+	if (item->flags & INODE_FLAG_EXTENTS)
+		item->extents = inode->extents;
+	else
+		item->location = inode->location;
+	reclaimer->count++;
+
+#ifdef _KERNEL_MODE
+	fs_unlock (&reclaimer->lock);
+	schedule_work (&reclaimer->work);
+#else
+	pthread_cond_signal (&reclaimer->wakeup);
+	fs_unlock (&reclaimer->lock);
+#endif
+
+	return 0;
+}
+
+int fs_reclaim_init (fs_t *fs) {
+	reclaimer_t *reclaimer = fs->super_block->reclaimer;
+
+	memset (reclaimer, 0, sizeof (reclaimer_t));
+	reclaimer->fs = fs;
+	fs_lock_init (&reclaimer->lock);
+
+#ifdef _KERNEL_MODE
+	INIT_WORK (&reclaimer->work, fs_reclaim_work);
+#else
+	pthread_cond_init (&reclaimer->wakeup, NULL);
+	pthread_cond_init (&reclaimer->idle, NULL);
+
+	pthread_once (&fs_reclaim_atfork_once, fs_reclaim_atfork);
+	pthread_mutex_lock (&fs_reclaimers_lock);
+	reclaimer->next = fs_reclaimers;
+	fs_reclaimers = reclaimer;
+	pthread_mutex_unlock (&fs_reclaimers_lock);
+#endif
+
+	return 0;
+}
+
+// stop the worker, whatever is still queued goes away with the device
+void fs_reclaim_destroy (fs_t *fs) {
+	reclaimer_t *reclaimer = fs->super_block->reclaimer;
+
+	if (reclaimer == NULL)
+		return;
+
+#ifdef _KERNEL_MODE
+	cancel_work_sync (&reclaimer->work);
+#else
+	reclaimer_t **p;
+	pthread_mutex_lock (&fs_reclaimers_lock);
+	for (p = &fs_reclaimers; *p != NULL; p = &(*p)->next)
+		if (*p == reclaimer) {
+			*p = reclaimer->next;
+			break;
+		}
+	pthread_mutex_unlock (&fs_reclaimers_lock);
+
+	if (reclaimer->pid == getpid ()) {
+		fs_lock (&reclaimer->lock);
+		reclaimer->stop = 1;
+		pthread_cond_signal (&reclaimer->wakeup);
+		fs_unlock (&reclaimer->lock);
+		pthread_join (reclaimer->thread, NULL);
+	}
+#endif
+}
+
+void* fs_free_block_number_to_addr (fs_t *fs, int free_block_number) {
+	return fs->device.locate (&fs->device, fs->super_block->geometry.offset_free_block + free_block_number);
+}
+
+void* fs_abs_block_number_to_addr (fs_t *fs, int abs_block_number) {
+	return fs->device.locate (&fs->device, abs_block_number);
+}
+
+// zeroed memory for the device, page aligned so page sized blocks are pages. kind
+// tells where it came from, huge pages first when FS_HUGE_PAGES
+static void* device_alloc (size_t size, unsigned char *kind) {
+	void *start;
+#ifdef FS_HUGE_PAGES
+	size_t huge = HUGE_PAGE_SIZE_IN_KB * 1024;
+#ifdef _KERNEL_MODE
+	struct page *page;
+#else
+	char *region;
+#endif
+#endif
+
+#ifdef _KERNEL_MODE
+	// physically contiguous, mapped with huge pages in the direct map
+#ifdef FS_HUGE_PAGES
+	if (size % huge == 0) {
+		page = alloc_pages (GFP_KERNEL | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN, get_order (size));
+		if (page != NULL) {
+			*kind = DEVICE_MEMORY_HUGE;
+			return page_address (page);
+		}
+	}
+#endif
+	start = malloc (size);
+	if (start != NULL)
+		memset (start, 0, size);
+	*kind = DEVICE_MEMORY_SMALL;
+#else
+#ifdef FS_HUGE_PAGES
+	// reserved huge pages
+	if (size % huge == 0) {
+		start = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (start != MAP_FAILED) {
+			*kind = DEVICE_MEMORY_HUGE;
+			return start;
+		}
+	}
+
+	// or transparent ones, they need the region aligned to one
+	if (size >= huge) {
+		size = (size + fs_page_size () - 1) / fs_page_size () * fs_page_size ();
+		region = mmap (NULL, size + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region != MAP_FAILED) {
+			start = (void *)(((unsigned long)region + huge - 1) / huge * huge);
+			if ((char *)start > region)
+				munmap (region, (char *)start - region);
+			munmap ((char *)start + size, region + huge - (char *)start);
+
+			*kind = madvise (start, size, MADV_HUGEPAGE) == 0 ? DEVICE_MEMORY_THP : DEVICE_MEMORY_SMALL;
+			return start;
+		}
+	}
+#endif
+
+	// anonymous memory is zero, and only there once touched
+	start = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (start == MAP_FAILED)
+		start = NULL;
+	*kind = DEVICE_MEMORY_SMALL;
+#endif
+
+	return start;
+}
+
+static void device_free (void *start, size_t size, unsigned char kind) {
+	if (start == NULL)
+		return;
+
+#ifdef _KERNEL_MODE
+	if (kind == DEVICE_MEMORY_HUGE)
+		__free_pages (virt_to_page (start), get_order (size));
+	else
+		free (start);
+#else
+	munmap (start, size);
+#endif
+}
+
+// bytes of a page, a huge one where the memory is on huge pages
+size_t device_page_size (unsigned char kind) {
+#ifdef FS_HUGE_PAGES
+	if (kind != DEVICE_MEMORY_SMALL)
+		return HUGE_PAGE_SIZE_IN_KB * 1024;
+#endif
+	return fs_page_size ();
+}
+
+// the metadata region up front, an empty chunk table for the free blocks
+int device_init (device_t *device, geometry_t *layout) {
+	unsigned int nr_of_free_blocks = layout->offset_limit - layout->offset_free_block;
+
+	device->block_size = layout->block_size;
+	device->nr_of_meta_blocks = layout->offset_free_block;
+	device->nr_of_blocks = layout->offset_limit;
+	device->locate = device_locate;
+
+	device->chunk_blocks = DEVICE_CHUNK_SIZE_IN_KB * 1024 / layout->block_size;
+	if (device->chunk_blocks == 0)
+		device->chunk_blocks = 1;
+	device->nr_of_chunks = (nr_of_free_blocks + device->chunk_blocks - 1) / device->chunk_blocks;
+	fs_lock_init (&device->lock);
+
+	device->start = device_alloc ((size_t)device->nr_of_meta_blocks * device->block_size, &device->meta_memory);
+	device->chunks = malloc (device->nr_of_chunks * sizeof (void *));
+	device->chunk_used = malloc (device->nr_of_chunks * sizeof (int));
+	device->chunk_memory = malloc (device->nr_of_chunks);
+	if (device->start == NULL || device->chunks == NULL || device->chunk_used == NULL || device->chunk_memory == NULL) {
+		device_destroy (device);
+		return -1;
+	}
+	device->limit = (char *)device->start + (size_t)device->nr_of_meta_blocks * device->block_size;
+
+	memset (device->chunks, 0, device->nr_of_chunks * sizeof (void *));
+	memset (device->chunk_used, 0, device->nr_of_chunks * sizeof (int));
+	memset (device->chunk_memory, DEVICE_MEMORY_SMALL, device->nr_of_chunks);
+
+	return 0;
+}
+
+void device_destroy (device_t *device) {
+	unsigned int i;
+
+	if (device->chunks != NULL && device->chunk_memory != NULL) {
+		for (i = 0; i < device->nr_of_chunks; i++)
+			device_free (device->chunks[i], device_chunk_size (device, i), device->chunk_memory[i]);
+	}
+
+	free (device->chunk_memory);
+	free (device->chunk_used);
+	free (device->chunks);
+	device_free (device->start, (size_t)device->nr_of_meta_blocks * device->block_size, device->meta_memory);
+}
+
+// NULL for a block whose chunk is not allocated
+void* device_locate (device_t *device, int absolute_block_number) {
+	unsigned int block, chunk;
+
+	if (absolute_block_number < device->nr_of_meta_blocks)
+		return (void *)((char *)device->start + (size_t)absolute_block_number * device->block_size);
+
+	block = absolute_block_number - device->nr_of_meta_blocks;
+	chunk = block / device->chunk_blocks;
+	if (device->chunks[chunk] == NULL)
+		return NULL;
+
+	return (void *)((char *)device->chunks[chunk] + (size_t)(block % device->chunk_blocks) * device->block_size);
+}
+
+// a free block goes into use, its chunk is allocated with the first one. NULL if out of memory
+void* device_take (device_t *device, int absolute_block_number) {
+	unsigned int chunk = (absolute_block_number - device->nr_of_meta_blocks) / device->chunk_blocks;
+	unsigned char kind;
+	void *memory;
+	int used;
+
+	for (;;) {
+		// the chunk is there as long as it has a block in use
+		used = device->chunk_used[chunk];
+		while (used > 0) {
+			if (__sync_bool_compare_and_swap (&device->chunk_used[chunk], used, used + 1))
+				return device_locate (device, absolute_block_number);
+			used = device->chunk_used[chunk];
+		}
+
+		// allocated outside the lock
+		memory = NULL;
+		if (device->chunks[chunk] == NULL) {
+			memory = device_alloc (device_chunk_size (device, chunk), &kind);
+			if (memory == NULL)
+				return NULL;
+		}
+
+		// someone else may have got there first
+		fs_lock (&device->lock);
+		if (device->chunks[chunk] == NULL && memory != NULL) {
+			device->chunks[chunk] = memory;
+			device->chunk_memory[chunk] = kind;
+			memory = NULL;
+		}
+		if (device->chunks[chunk] != NULL) {
+			__sync_fetch_and_add (&device->chunk_used[chunk], 1);
+			fs_unlock (&device->lock);
+			device_free (memory, device_chunk_size (device, chunk), kind);
+			return device_locate (device, absolute_block_number);
+		}
+		fs_unlock (&device->lock);
+	}
+}
+
+// n blocks from absolute_block_number on are free again. a chunk left with none
+// stays until device_release, so a block freed and taken again does not cost one
+void device_put (device_t *device, int absolute_block_number, int n) {
+	unsigned int block = absolute_block_number - device->nr_of_meta_blocks;
+	unsigned int chunk, count;
+	int used;
+
+	__sync_fetch_and_add (&device->nr_of_freed, n);
+
+	while (n > 0) {
+		chunk = block / device->chunk_blocks;
+		count = device->chunk_blocks - block % device->chunk_blocks;
+		count = count < n ? count : n;
+		block += count;
+		n -= count;
+
+		// not the last blocks of the chunk
+		used = device->chunk_used[chunk];
+		while (used > count) {
+			if (__sync_bool_compare_and_swap (&device->chunk_used[chunk], used, used - count))
+				break;
+			used = device->chunk_used[chunk];
+		}
+		if (used > count)
+			continue;
+
+		// the last ones, against a release
+		fs_lock (&device->lock);
+		__sync_sub_and_fetch (&device->chunk_used[chunk], count);
+		fs_unlock (&device->lock);
+	}
+}
+
+// bytes of the chunk, the last one may be short
+size_t device_chunk_size (device_t *device, unsigned int chunk) {
+	unsigned int blocks = device->nr_of_blocks - device->nr_of_meta_blocks - chunk * device->chunk_blocks;
+
+	blocks = blocks < device->chunk_blocks ? blocks : device->chunk_blocks;
+	return (size_t)blocks * device->block_size;
+}
+
+// give a chunk with no block in use back to the host, its size or 0
+size_t device_release (device_t *device, unsigned int chunk) {
+	void *memory = NULL;
+	unsigned char kind = DEVICE_MEMORY_SMALL;
+
+	fs_lock (&device->lock);
+	if (device->chunk_used[chunk] == 0) {
+		memory = device->chunks[chunk];
+		kind = device->chunk_memory[chunk];
+		device->chunks[chunk] = NULL;
+	}
+	fs_unlock (&device->lock);
+
+	// freed outside the lock
+	if (memory == NULL)
+		return 0;
+	device_free (memory, device_chunk_size (device, chunk), kind);
+
+	return device_chunk_size (device, chunk);
+}
+
+// bytes of host memory the device holds now
+unsigned long long device_resident (device_t *device) {
+	unsigned long long resident = (unsigned long long)device->nr_of_meta_blocks * device->block_size;
+	unsigned int chunk;
+	size_t size;
+#ifndef _KERNEL_MODE
+	unsigned char *pages;
+	size_t i, nr_of_pages;
+#endif
+
+	for (chunk = 0; chunk < device->nr_of_chunks; chunk++) {
+		if (device->chunks[chunk] == NULL)
+			continue;
+		size = device_chunk_size (device, chunk);
+
+#ifdef _KERNEL_MODE
+		resident += size;
+#else
+		// the pages given back with madvise are not there until touched again
+		nr_of_pages = (size + fs_page_size () - 1) / fs_page_size ();
+		pages = malloc (nr_of_pages);
+		if (pages == NULL || mincore (device->chunks[chunk], size, pages) != 0) {
+			resident += size;
+			free (pages);
+			continue;
+		}
+		for (i = 0; i < nr_of_pages; i++)
+			resident += (pages[i] & 1) ? fs_page_size () : 0;
+		free (pages);
+#endif
+	}
+
+	return resident;
+}
+
+
+// locate the offset according to location object
+void* loc_locate (super_block_t *sb, location_t *location, long long offset) {
+
+	// assert (location != NULL);
+	// assert (offset >= 0 && offset < sb->geometry.limit_triple_indirect);
+
+	geometry_t *geometry = &sb->geometry;
+	location_index_t index;
+
+	// get the index first
+	loc_index (geometry, location, offset, &index);
+	block_number_t block;
 
 	// one level indexing
-	if (offset < LOC_LIMIT_DIRECT) {
+	if (offset < geometry->limit_direct) {
 
-		p = location->direct[index.level_1];
+		block = location->direct[index.level_1];
 
 		// not allocated yet
-		if (p == NULL)
+		if (block == LOC_NO_BLOCK)
 			return NULL;
 
 		// allocated, offset by byte
-		return (void *)((char *)p + (offset % BLOCK_SIZE_IN_B));
+		return (char *)fs_free_block_number_to_addr (sb->fs, block) + offset % geometry->block_size;
 	}
 		
 	// two level indexing
-	if (offset < LOC_LIMIT_SINGLE_INDIRECT) {
+	if (offset < geometry->limit_single_indirect) {
 
 		// not allocated yet
-		p = location->single_indirect[index.level_1];
-		if (p == NULL)
+		block = location->single_indirect[index.level_1];
+		if (block == LOC_NO_BLOCK)
 			return NULL;
 
-		// still not allocated yet, offset by 4 bytes
-		p = (void *)((void **)p + index.level_2);
-		p = *(void **)p;
-		if (p == NULL)
+		// still not allocated yet, offset by a block number
+		block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_2];
+		if (block == LOC_NO_BLOCK)
 			return NULL;
 
 		// allocated, offset by byte
-		return (void *)((char *)p + (offset % BLOCK_SIZE_IN_B));
+		return (char *)fs_free_block_number_to_addr (sb->fs, block) + offset % geometry->block_size;
 	}
 
 	// three level indexing
+	if (offset < geometry->limit_double_indirect) {
+
+		// not allocated yet
+		block = location->double_indirect[index.level_1];
+		if (block == LOC_NO_BLOCK)
+			return NULL;
+
+		// still not allocated yet
+		block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_2];
+		if (block == LOC_NO_BLOCK)
+			return NULL;
+
+		// still not allocated yet
+		block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_3];
+		if (block == LOC_NO_BLOCK)
+			return NULL;
+
+		// allocated, offset by byte
+		return (char *)fs_free_block_number_to_addr (sb->fs, block) + offset % geometry->block_size;
+	}
+
+	// four level indexing
 
 	// not allocated yet
-	p = location->double_indirect[index.level_1];
-	if (p == NULL)
+	block = location->triple_indirect[index.level_1];
+	if (block == LOC_NO_BLOCK)
+		return NULL;
+
+	// still not allocated yet
+	block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_2];
+	if (block == LOC_NO_BLOCK)
 		return NULL;
 
 	// still not allocated yet
-	p = (void *)((void **)p + index.level_2);
-	p = *(void **)p;
-	if (p == NULL)
+	block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_3];
+	if (block == LOC_NO_BLOCK)
 		return NULL;
 
 	// still not allocated yet
-	p = (void *)((void **)p + index.level_3);
-	p = *(void **)p;
-	if (p == NULL)
+	block = ((block_number_t *)fs_free_block_number_to_addr (sb->fs, block))[index.level_4];
+	if (block == LOC_NO_BLOCK)
 		return NULL;
 
 	// allocated, offset by byte
-	return (void *)((char *)p + (offset % BLOCK_SIZE_IN_B));
+	return (char *)fs_free_block_number_to_addr (sb->fs, block) + offset % geometry->block_size;
 }
 
 
 // compute the expected index for indexing location object of a given offset
-int loc_index (location_t *location, int offset, location_index_t *index) {
+int loc_index (geometry_t *geometry, location_t *location, long long offset, location_index_t *index) {
 	
 	// assert (location != NULL);
-	// assert (offset >= 0 && offset < LOC_LIMIT_DOUBLE_INDIRECT);
+	// assert (offset >= 0 && offset < geometry->limit_triple_indirect);
 	// assert (index != NULL);
 
+	long long rest = offset;
+
 	index->level_1 = -1;
 	index->level_2 = -1;
 	index->level_3 = -1;
+	index->level_4 = -1;
 
 	// first level
-	if (offset < LOC_LIMIT_DIRECT) {
-		index->level_1 = offset / LOC_SIZE_1_LEVEL;
+	if (rest < geometry->limit_direct) {
+		index->level_1 = rest / geometry->size_1_level;
 		return 0;
 	}
 
 	// second level
-	if (offset < LOC_LIMIT_SINGLE_INDIRECT) {
-		offset -= LOC_LIMIT_DIRECT;
-		index->level_1 = offset / LOC_SIZE_2_LEVEL;
+	if (rest < geometry->limit_single_indirect) {
+		rest -= geometry->limit_direct;
+		index->level_1 = rest / geometry->size_2_level;
 
-		offset %= LOC_SIZE_2_LEVEL;
-		index->level_2 = offset / LOC_SIZE_1_LEVEL;
+		rest %= geometry->size_2_level;
+		index->level_2 = rest / geometry->size_1_level;
 
 		return 0;
 	}
 
 	// third level
-	offset -= LOC_LIMIT_SINGLE_INDIRECT;
-	index->level_1 = offset / LOC_SIZE_3_LEVEL;
+	if (rest < geometry->limit_double_indirect) {
+		rest -= geometry->limit_single_indirect;
+		index->level_1 = rest / geometry->size_3_level;
 
-	offset %= LOC_SIZE_3_LEVEL;
-	index->level_2 = offset / LOC_SIZE_2_LEVEL;
+		rest %= geometry->size_3_level;
+		index->level_2 = rest / geometry->size_2_level;
 
-	offset %= LOC_SIZE_2_LEVEL;
-	index->level_3 = offset / LOC_SIZE_1_LEVEL;
+		rest %= geometry->size_2_level;
+		index->level_3 = rest / geometry->size_1_level;
+
+		return 0;
+	}
+
+	// fourth level
+	rest -= geometry->limit_double_indirect;
+	index->level_1 = rest / geometry->size_4_level;
+
+	rest %= geometry->size_4_level;
+	index->level_2 = rest / geometry->size_3_level;
+
+	rest %= geometry->size_3_level;
+	index->level_3 = rest / geometry->size_2_level;
+
+	rest %= geometry->size_2_level;
+	index->level_4 = rest / geometry->size_1_level;
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -2,47 +2,163 @@
 #define _FS_H
 #include "config.h"
 
+#ifdef _KERNEL_MODE
+	#include <linux/spinlock.h>
+	#include <linux/smp.h>
+	#include <linux/sched.h>
+	#include <linux/workqueue.h>
+
+	typedef spinlock_t fs_lock_t;
+	#define fs_lock_init(lock)	spin_lock_init (lock)
+	#define fs_lock(lock)		spin_lock (lock)
+	#define fs_unlock(lock)		spin_unlock (lock)
+	#define fs_cpu_id()			(raw_smp_processor_id () % FS_NR_OF_CPUS)
+	#define fs_page_size()		PAGE_SIZE
+	#define fs_yield()			cond_resched ()
+#else
+	#include <pthread.h>
+	#include <sched.h>
+	#include <unistd.h>
+
+	typedef pthread_mutex_t fs_lock_t;
+	#define fs_lock_init(lock)	pthread_mutex_init (lock, NULL)
+	#define fs_lock(lock)		pthread_mutex_lock (lock)
+	#define fs_unlock(lock)		pthread_mutex_unlock (lock)
+	#define fs_yield()			sched_yield ()
+	#define fs_page_size()		sysconf (_SC_PAGESIZE)
+	int fs_cpu_id ();
+#endif
+
 //#define bitmap_set 		____bitmap_set
 //#define bitmap_test 	____bitmap_test
 //#define bitmap_clear 	____bitmap_clear
 
 struct fs_t;
 
+// relative to the first free block, so the image does not depend on where it is mapped
+typedef unsigned int block_number_t;
+
+// index blocks are arrays of block numbers, LOC_NO_BLOCK where nothing is allocated
 typedef struct location_t {
-	void *direct[LOC_NR_OF_DIRECT];
-	void *single_indirect[LOC_NR_OF_SINGLE_INDIRECT];
-	void *double_indirect[LOC_NR_OF_DOUBLE_INDIRECT];
+	block_number_t direct[LOC_NR_OF_DIRECT];
+	block_number_t single_indirect[LOC_NR_OF_SINGLE_INDIRECT];
+	block_number_t double_indirect[LOC_NR_OF_DOUBLE_INDIRECT];
+	block_number_t triple_indirect[LOC_NR_OF_TRIPLE_INDIRECT];
 } location_t;
 
 typedef struct location_index_t {
 	int level_1;
 	int level_2;
 	int level_3;
+	int level_4;
 } location_index_t;
 
+// a run of blocks. in an index node, physical is the child node holding the
+// extents from logical on
+typedef struct extent_t {
+	unsigned int logical;
+	block_number_t physical;
+	unsigned int length;
+} extent_t;
+
+// starts the root in the inode and every extent block, the extents follow
+typedef struct extent_header_t {
+	unsigned short count;
+	unsigned short depth;	// 0 for a leaf
+} extent_header_t;
+
+typedef struct extent_root_t {
+	extent_header_t header;
+	extent_t extents[EXTENT_NR_OF_INLINE];
+} extent_root_t;
+
 typedef union index_node_t {
 	char _fill[INODE_SIZE_IN_B];
 	struct {
 		unsigned char in_use;
 		unsigned char type[INODE_TYPE_SIZE];
-		unsigned long size;
-		location_t location;
+		unsigned char flags;
+		unsigned long long size;
+		union {
+			location_t location;
+			extent_root_t extents;	// INODE_FLAG_EXTENTS
+			unsigned char data[INODE_INLINE_DATA_SIZE];	// INODE_FLAG_INLINE
+		};
 	};
 } index_node_t;
 
+// what lookups and type checks read of an inode, packed apart from the table so a
+// cache line holds 8 of them. a copy, kept in step by inode_set_size and inode_set_type
+typedef struct inode_hot_t {
+	unsigned long long	size : 48;		// max_extent_file_size fits
+	unsigned long long	kind : 8;		// INODE_KIND_
+	unsigned long long	in_use : 8;
+} inode_hot_t;
+
 typedef struct index_node_ops_t {
 	index_node_t *start, *limit;
 	int (*allocate) ();
 	int (*free) (struct index_node_ops_t *op, int index);
 } index_node_ops_t;
 
+// disk layout, everything below nr_of_inodes is computed by geometry_compute
+typedef struct geometry_t {
+	unsigned int disk_size_in_kb;
+	unsigned int block_size;
+	unsigned int nr_of_inodes;
+
+	// in blocks
+	unsigned int offset_inode_array;
+	unsigned int offset_block_bitmap;
+	unsigned int offset_free_block;
+	unsigned int offset_limit;
+
+	// location object limits, in bytes
+	unsigned int pointer_per_block;
+	unsigned int extents_per_block;
+	long long size_1_level, size_2_level, size_3_level, size_4_level;
+	long long limit_direct, limit_single_indirect, limit_double_indirect, limit_triple_indirect;
+	long long max_file_size;
+	long long max_extent_file_size;
+} geometry_t;
+
+// where the memory of a region of the device came from
+#define DEVICE_MEMORY_SMALL		0	// host pages
+#define DEVICE_MEMORY_HUGE		1	// huge pages: hugetlb ones, or contiguous pages in the kernel
+#define DEVICE_MEMORY_THP		2	// host pages, advised for transparent huge pages
+
+// the metadata blocks sit in one region from start to limit. the free blocks come
+// in chunks of chunk_blocks, allocated when the first block of one goes into use
 typedef struct device_t {
 	void *start, *limit;
+	unsigned int block_size;
+	unsigned int nr_of_meta_blocks;
+	unsigned int nr_of_blocks;
+
+	unsigned int chunk_blocks;
+	unsigned int nr_of_chunks;
+	void **chunks;
+	int *chunk_used;			// blocks in use per chunk
+	unsigned char *chunk_memory;	// DEVICE_MEMORY_ per chunk
+	unsigned char meta_memory;
+	fs_lock_t lock;				// allocating and releasing chunks
+	unsigned int nr_of_freed;	// blocks freed since the last release pass
+
 	void* (*locate) (struct device_t *device, int absolute_block_number);
 } device_t;
 
+typedef unsigned long long bitmap_word_t;
+
 typedef struct bitmap_ops_t {
 	void *start, *limit;
+	unsigned int nr_of_bits;
+	unsigned int cursor;
+
+	// levels[0] is the bitmap itself, a bit at levels[n] marks a full word at levels[n - 1]
+	bitmap_word_t *levels[BITMAP_MAX_LEVELS];
+	unsigned int nr_of_words[BITMAP_MAX_LEVELS];
+	int nr_of_levels;
+
 	unsigned int (*first_free) (struct bitmap_ops_t *op);
 	unsigned int (*test) (struct bitmap_ops_t *op, int free_block_number);
 	unsigned int (*set) (struct bitmap_ops_t *op, int free_block_number);
@@ -50,23 +166,141 @@ typedef struct bitmap_ops_t {
 	unsigned int (*clear_all) (struct bitmap_ops_t *op); 
 } bitmap_ops_t;
 
+// free blocks cached per cpu, their bits stay set in the bitmap
+typedef struct block_magazine_t {
+	fs_lock_t		lock;
+	int				count;
+	unsigned int	blocks[BLOCK_MAGAZINE_SIZE];
+
+	// this cpu's share of the free block counter, may go negative
+	int				free_blocks;
+} __attribute__ ((aligned (64))) block_magazine_t;
+
+typedef struct block_allocator_t {
+	fs_lock_t			lock;		// protects the bitmap
+	block_magazine_t	magazines[FS_NR_OF_CPUS];
+} block_allocator_t;
+
+// the block map of a removed inode, as it was detached from it
+typedef struct reclaim_item_t {
+	unsigned char	flags;		// INODE_FLAG_EXTENTS for an extent tree
+	union {
+		location_t		location;
+		extent_root_t	extents;
+	};
+} reclaim_item_t;
+
+// block maps of removed inodes, freed in the background
+typedef struct reclaimer_t {
+	struct fs_t		*fs;
+	fs_lock_t		lock;
+	reclaim_item_t	queue[RECLAIM_QUEUE_SIZE];
+	int				head, count;
+	int				running;	// taken off the queue, blocks not all back yet
+
+#ifdef _KERNEL_MODE
+	struct work_struct	work;
+#else
+	pthread_t		thread;
+	pthread_cond_t	wakeup;
+	pthread_cond_t	idle;		// signalled when the worker puts down a location
+	int				pid;		// process running the worker thread
+	int				stop;
+	int				busy;		// the worker is freeing blocks, allocator locks and all
+	int				paused;		// a fork is under way, the worker takes nothing new
+	struct reclaimer_t	*next;	// every reclaimer, for the fork handlers
+#endif
+} reclaimer_t;
+
 typedef struct dir_entry_t {
 	unsigned char 	filename[MAX_FILE_COMPONENT];
 	unsigned short 	inode;
 } dir_entry_t;
 
+// a removed dentry, as it is on the device: inode 0, which never has a dentry,
+// and where the name was, the slot of the next one, -1 at the end. the same
+// size and inode offset as dir_entry_t, the slot in host byte order
+typedef struct dir_tombstone_t {
+	int				next;
+	unsigned char	unused[MAX_FILE_COMPONENT - sizeof (int)];
+	unsigned short	inode;
+} dir_tombstone_t;
+
+// the dentry of a child inode, hashed by parent and name. an inode has one dentry
+// at most, so the nodes are indexed by the child. a removed dentry leaves a
+// tombstone that the next create in the directory reuses
+typedef struct dir_index_node_t {
+	unsigned char	filename[MAX_FILE_COMPONENT];
+	unsigned short	parent;
+	int				next;		// next child in the bucket, -1 at the end
+	unsigned int	position;	// dentry slot in the parent
+	int				left;		// children in the name order, -1 if none
+	int				right;
+
+	// of the child as a directory
+	unsigned int	nr_of_entries;	// live dentries, the rest of its slots are tombstones
+	int				free_slot;		// first tombstone, -1 if none
+	unsigned int	generation;		// bumped when a name comes into it, or it goes
+	unsigned int	nr_of_opens;	// fds on it, no dentry moves while there are any
+} dir_index_node_t;
+
+// name lookups in every directory, in memory. the nodes are also a treap
+// ordered by parent then name, so the names of a directory can be walked in
+// order from any point
+typedef struct dir_index_t {
+	int					*buckets;	// first child, -1 if empty
+	unsigned int		mask;
+	dir_index_node_t	*nodes;		// nr_of_inodes entries
+	int					root;		// of the treap, -1 if empty
+} dir_index_t;
+
+// names of a directory in [from, to), or starting with from if prefix is set.
+// an empty to has no bound. a scan resumes past cursor if it is not empty, and
+// leaves the last name it returned there
+typedef struct dir_range_t {
+	char	from[MAX_FILE_COMPONENT];
+	char	to[MAX_FILE_COMPONENT];
+	char	cursor[MAX_FILE_COMPONENT];
+	int		prefix;
+} dir_range_t;
+
+// a resolved path, inode -1 for one that does not exist, and the last lookup
+// that decided it. a hit is good while its dentry is still that name in dir,
+// a miss while dir has not had a name come in, so churn in one directory
+// leaves what was cached for the others alone
+typedef struct dentry_cache_entry_t {
+	char			path[MAX_FILE_FULL + 1];	// empty if the slot is unused
+	int				parent;			// resolved to the parent, not the path itself
+	int				inode;
+	int				dir;			// where the last lookup went, -1 if none did
+	unsigned short	component;		// the name looked up there, within path
+	unsigned short	length;
+	unsigned int	generation;		// of dir, for a miss
+	unsigned int	renamed;
+} dentry_cache_entry_t;
+
+typedef struct dentry_cache_t {
+	dentry_cache_entry_t	*entries;	// DENTRY_CACHE_SIZE slots, hashed by path
+	unsigned int			renamed;	// bumped when a dir moves, every path below it changes
+} dentry_cache_t;
+
 typedef struct super_block_t {
 	struct fs_t		*fs;
+	geometry_t		geometry;
 
 	union index_node_t 	*inodes;
 	void 				*bitmap;
-	void 				*blocks;
 
 	struct index_node_ops_t	inode_ops;
 	struct bitmap_ops_t		bitmap_ops;
+	struct block_allocator_t	*allocator;
+	struct reclaimer_t			*reclaimer;
 
 	unsigned int 	free_inodes;
-	unsigned int 	free_blocks;
+	unsigned short	*free_inode_stack;	// free_inodes entries, top at the end
+	inode_hot_t		*inode_hot;			// nr_of_inodes entries
+	dir_index_t		dir_index;
+	dentry_cache_t	dentry_cache;
 
 	unsigned int (*lookup) (struct super_block_t *sb, unsigned char *fullname);
 } super_block_t;
@@ -76,7 +310,23 @@ typedef struct fs_t {
 	struct super_block_t	*super_block;
 } fs_t;
 
-
+// host memory behind the device against what it can hold, in bytes, and inodes
+typedef struct fs_stat_t {
+	unsigned long long	capacity;
+	unsigned long long	resident;
+	unsigned long long	in_use;		// metadata and blocks in use
+	unsigned int		block_size;
+	unsigned int		nr_of_chunks;
+	unsigned int		nr_of_resident_chunks;
+	unsigned int		nr_of_huge_chunks;	// of the resident ones, on huge pages or advised for transparent ones
+	unsigned int		meta_on_huge_pages;
+	unsigned int		nr_of_inodes;
+	unsigned int		free_inodes;
+} fs_stat_t;
+
+
+int bitmap_init (struct bitmap_ops_t *op, void *start, void *limit, unsigned int nr_of_bits);
+void bitmap_destroy (struct bitmap_ops_t *op);
 unsigned int bitmap_first_free (struct bitmap_ops_t *op); 
 unsigned int bitmap_test (struct bitmap_ops_t *op, int free_block_number );
 unsigned int bitmap_set_ (struct bitmap_ops_t *op, int free_block_number);
@@ -84,61 +334,111 @@ unsigned int bitmap_clear_ (struct bitmap_ops_t *op, int free_block_number);
 unsigned int bitmap_clear_all (struct bitmap_ops_t *op);
 
 
-int fs_addr_to_free_block_number (fs_t *fs, void *free_block_addr);
+void* fs_free_block_number_to_addr (fs_t *fs, int free_block_number);
 void* fs_abs_block_number_to_addr (fs_t *fs, int abs_block_number);
+int device_init (device_t *device, geometry_t *layout);
+void device_destroy (device_t *device);
 void* device_locate (device_t *device, int absolute_block_number);
+void* device_take (device_t *device, int absolute_block_number);
+void device_put (device_t *device, int absolute_block_number, int n);
+size_t device_chunk_size (device_t *device, unsigned int chunk);
+size_t device_page_size (unsigned char kind);
+size_t device_release (device_t *device, unsigned int chunk);
+unsigned long long device_resident (device_t *device);
 
 char* path_get_component (char *components, int index);
-void* loc_locate (location_t *location, int offset);
-void *fs_allocate_block (fs_t *fs);
+void* loc_locate (super_block_t *sb, location_t *location, long long offset);
+block_number_t fs_allocate_block (fs_t *fs);
 
 
-
-fs_t* init_fs ();
+void geometry_default (geometry_t *geometry);
+int geometry_compute (geometry_t *geometry);
+fs_t* init_fs (geometry_t *geometry);
 
 int destroy_fs (fs_t *fs);
 
-int inode_create (super_block_t *sb, char *pathname, char *type);
+int inode_create (super_block_t *sb, int parent, char *name, char *type);
+int inode_link (super_block_t *sb, int parent, char *name, int child);
+int inode_put_dentry (super_block_t *sb, int parent, dir_entry_t *dentry, unsigned int *position);
 
 int fs_mk (fs_t *fs, char *pathname, char *type);
 
 int fs_rm (fs_t *fs, char *pathname);
-int inode_rm (super_block_t *sb, char *pathname);
+int fs_rename (fs_t *fs, char *oldpath, char *newpath);
+int inode_rm (super_block_t *sb, int parent, int child, char *name);
 
+void inode_set_size (super_block_t *sb, int index, long long size);
+void inode_set_type (super_block_t *sb, int index, char *type);
 int inode_isdir_isempty (super_block_t *sb, int index);
 int inode_isdir (super_block_t *sb, int index);
 int inode_isreg (super_block_t *sb, int index);
 int inode_lookup_dentry (super_block_t *sb, int inode, char *component);
+int dir_index_init (super_block_t *sb);
+void dir_index_destroy (super_block_t *sb);
+void dir_index_insert (super_block_t *sb, int parent, char *name, int child, unsigned int position);
+int dir_index_lookup (super_block_t *sb, int parent, char *name);
+void dir_index_remove (super_block_t *sb, int child);
+int inode_scandir (super_block_t *sb, int inode, dir_range_t *range, dir_entry_t *entries, int nr_of_entries);
 int inode_remove_dentry (super_block_t *sb, int inode, int dentry);
+int inode_bury_dentry (super_block_t *sb, int inode, int dentry);
+void inode_compact_dir (super_block_t *sb, int inode);
+void inode_open_dir (super_block_t *sb, int inode);
+void inode_close_dir (super_block_t *sb, int inode);
+int inode_readdir (super_block_t *sb, int inode, unsigned int *slot, dir_entry_t *entries, int nr_of_entries);
+int dentry_cache_lookup (super_block_t *sb, char *path, int parent, int *inode);
+void dentry_cache_store (super_block_t *sb, char *path, int parent, int inode, int dir, char *component, int length);
 
 int inode_lookup (super_block_t *sb, int parent, char *childname) ;
 int inode_lookup_full (super_block_t *sb, char *fullname) ;
 
 int inode_lookup_parent (super_block_t *sb, char *child) ;
+int inode_resolve (super_block_t *sb, char *pathname, int *parent, int *child, char *name);
 
 int inode_allocate (super_block_t *sb);
 
 int inode_free (super_block_t *sb, int index);
 char* path_get_component (char *components, int index);
 int path_explode (char *path, char *components) ;
-int fs_read (fs_t *fs, int index, int offset, void *buffer, int len);
-int fs_write (fs_t *fs, int index, int offset, void *buffer, int len) ;
-int fs_append (fs_t *fs, int index, void *buffer, int len);
-
-int inode_append (super_block_t *sb, int index, void *buffer, int len);
-
-int inode_write (super_block_t *sb, int index, int offset, void *buffer, int len);
-int inode_read (super_block_t *sb, int index, int offset, void *buffer, int len);
-int inode_resize (super_block_t *sb, int index, int size) ;
-int inode_shrink (super_block_t	*sb, int index, int size);
-int inode_shrink_1_level (super_block_t *sb, void **p);
-int inode_expand (super_block_t *sb, int index, int size);
-
-void *fs_allocate_block (fs_t *fs);
+long long fs_read (fs_t *fs, int index, long long offset, void *buffer, long long len);
+long long fs_write (fs_t *fs, int index, long long offset, void *buffer, long long len) ;
+long long fs_append (fs_t *fs, int index, void *buffer, long long len);
+
+long long inode_append (super_block_t *sb, int index, void *buffer, long long len);
+
+long long inode_write (super_block_t *sb, int index, long long offset, void *buffer, long long len);
+long long inode_read (super_block_t *sb, int index, long long offset, void *buffer, long long len);
+long long inode_zero (super_block_t *sb, int index, long long offset, long long len);
+long long inode_resize (super_block_t *sb, int index, long long size) ;
+long long inode_shrink (super_block_t	*sb, int index, long long size);
+int inode_shrink_1_level (super_block_t *sb, block_number_t *p);
+int inode_release (super_block_t *sb, int index);
+int loc_truncate (super_block_t *sb, location_t *location, long long from, int budget);
+long long inode_expand (super_block_t *sb, int index, long long size);
+int inode_uninline (super_block_t *sb, int index);
+long long inode_map (super_block_t *sb, int index, long long offset, long long len);
+long long inode_max_size (super_block_t *sb, int index);
+void* inode_locate (super_block_t *sb, int index, long long offset, long long *run);
+
+extent_t* ext_lookup (super_block_t *sb, extent_root_t *root, unsigned int logical);
+int ext_insert (super_block_t *sb, extent_root_t *root, unsigned int logical, block_number_t physical, unsigned int length);
+int ext_truncate (super_block_t *sb, extent_root_t *root, unsigned int from);
+
+int fs_allocate_blocks (fs_t *fs, int n, block_number_t *out);
+int fs_count_free_blocks (fs_t *fs);
+long long fs_release_memory (fs_t *fs);
+void fs_release_memory_check (fs_t *fs);
+int fs_stat (fs_t *fs, fs_stat_t *stat);
+
+int fs_reclaim_init (fs_t *fs);
+void fs_reclaim_destroy (fs_t *fs);
+int fs_reclaim_queue (fs_t *fs, index_node_t *inode);
+int fs_reclaim_run (fs_t *fs);
+int fs_reclaim_help (fs_t *fs);
 int fs_free_block (fs_t *fs, int free_block_number);
-int fs_addr_to_block_number (fs_t *fs, void *free_block_addr);
-void* loc_locate (location_t *location, int offset);
+int fs_free_blocks (fs_t *fs, int first, int n);
+void* loc_locate (super_block_t *sb, location_t *location, long long offset);
+block_number_t* loc_slot (super_block_t *sb, location_t *location, long long offset);
 
-int loc_index (location_t *location, int offset, location_index_t *index);
+int loc_index (geometry_t *geometry, location_t *location, long long offset, location_index_t *index);
 
 #endif
\ No newline at end of file
@@ -85,11 +85,11 @@ int rd_write (int fd, char *buffer, int len) {
 	return status;
 
 }
-int rd_lseek (int fd, int offset) {
+int rd_lseek (int fd, long long offset) {
 	int status;
 	command_t command = {
 		.fd = fd,
-		.len = offset,
+		.offset = offset,
 		.status = &status
 	};
 	ioctl (g_fd, IOC_LSEEK, &command);
@@ -108,6 +108,22 @@ int rd_unlink (char *pathname) {
 	pthread_mutex_unlock (&g_mutex);
 	return status;
 
+}
+// newpath is passed in buffer, its length in offset
+int rd_rename (char *oldpath, char *newpath) {
+	int status;
+	command_t command = {
+		.pathname = oldpath,
+		.len = strlen (oldpath),
+		.buffer = newpath,
+		.offset = strlen (newpath),
+		.status = &status
+	};
+	pthread_mutex_lock (&g_mutex);
+	ioctl (g_fd, IOC_RENAME, &command);
+	pthread_mutex_unlock (&g_mutex);
+	return status;
+
 }
 int rd_readdir (int fd, char *buffer) {
 	int status;
@@ -119,4 +135,68 @@ int rd_readdir (int fd, char *buffer) {
 	ioctl (g_fd, IOC_READDIR, &command);
 	return status;
 
+}
+// entries that fit in len, resuming at *cookie, 0 past the last one. the
+// module copies out READDIR_MAX_ENTRIES at most, call again for the rest
+int rd_readdir_many (int fd, char *buffer, int len, long long *cookie) {
+	int status;
+	command_t command = {
+		.fd = fd,
+		.buffer = buffer,
+		.len = len,
+		.offset = *cookie,
+		.status = &status
+	};
+	ioctl (g_fd, IOC_READDIR_MANY, &command);
+	*cookie = command.offset;
+	return status;
+
+}
+int rd_statfs (fs_stat_t *stat) {
+	int status;
+	command_t command = {
+		.buffer = (char *)stat,
+		.status = &status
+	};
+	ioctl (g_fd, IOC_STATFS, &command);
+	return status;
+
+}
+int rd_release_memory (fs_stat_t *stat) {
+	int status;
+	command_t command = {
+		.buffer = (char *)stat,
+		.status = &status
+	};
+	pthread_mutex_lock (&g_mutex);
+	ioctl (g_fd, IOC_RELEASE, &command);
+	pthread_mutex_unlock (&g_mutex);
+	return status;
+
+}
+int rd_readdir_range (int fd, dir_range_t *range, char *buffer, int len) {
+	int status;
+	command_t command = {
+		.fd = fd,
+		.pathname = (char *)range,
+		.buffer = buffer,
+		.len = len,
+		.status = &status
+	};
+	ioctl (g_fd, IOC_READDIR_RANGE, &command);
+	return status;
+
+}
+// names starting with prefix, cursor empty to start and left at the last name
+int rd_readdir_prefix (int fd, char *prefix, char *cursor, char *buffer, int len) {
+	dir_range_t range;
+	memset (&range, 0, sizeof (range));
+	strncpy (range.from, prefix, sizeof (range.from) - 1);
+	strncpy (range.cursor, cursor, sizeof (range.cursor) - 1);
+	range.prefix = 1;
+
+	int status = rd_readdir_range (fd, &range, buffer, len);
+	memcpy (cursor, range.cursor, sizeof (range.cursor));
+	return status;
+
 }
\ No newline at end of file
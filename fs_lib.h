@@ -2,6 +2,7 @@
 #define _FS_LIB_H
 
 #include <pthread.h>
+#include "config.h"
 
 extern pthread_mutex_t g_mutex;
 typedef struct command_t {
@@ -10,8 +11,31 @@ typedef struct command_t {
 	char 	*buffer;
 	int 	len;
 	int 	*status;
+	long long	offset;
 } command_t;
 
+// host memory behind the disk against what it can hold, in bytes
+typedef struct fs_stat_t {
+	unsigned long long	capacity;
+	unsigned long long	resident;
+	unsigned long long	in_use;
+	unsigned int		block_size;
+	unsigned int		nr_of_chunks;
+	unsigned int		nr_of_resident_chunks;
+	unsigned int		nr_of_huge_chunks;
+	unsigned int		meta_on_huge_pages;
+} fs_stat_t;
+
+// names of a directory in [from, to), or starting with from if prefix is set.
+// an empty to has no bound. a scan resumes past cursor if it is not empty.
+// the same layout as in fs.h, the module copies it as is
+typedef struct dir_range_t {
+	char	from[MAX_FILE_COMPONENT];
+	char	to[MAX_FILE_COMPONENT];
+	char	cursor[MAX_FILE_COMPONENT];
+	int		prefix;
+} dir_range_t;
+
 #define MAGIC 'k'
 
 #define IOC_READ 	_IOWR (MAGIC, 0, command_t)
@@ -23,6 +47,11 @@ typedef struct command_t {
 #define IOC_UNLINK	_IOWR (MAGIC, 6, command_t)
 #define IOC_READDIR _IOWR (MAGIC, 7, command_t)
 #define IOC_LSEEK	_IOWR (MAGIC, 8, command_t)
+#define IOC_STATFS	_IOWR (MAGIC, 9, command_t)
+#define IOC_RELEASE	_IOWR (MAGIC, 10, command_t)
+#define IOC_READDIR_MANY	_IOWR (MAGIC, 11, command_t)
+#define IOC_READDIR_RANGE	_IOWR (MAGIC, 12, command_t)
+#define IOC_RENAME	_IOWR (MAGIC, 13, command_t)
 
 int rd_creat (char *pathname);
 int rd_mkdir (char *pathname);
@@ -30,9 +59,15 @@ int rd_open (char *pathname);
 int rd_close (int fd);
 int rd_read (int fd, char *buffer, int len);
 int rd_write (int fd, char *buffer, int len);
-int rd_lseek (int fd, int offset);
+int rd_lseek (int fd, long long offset);
 int rd_unlink (char *pathname);
+int rd_rename (char *oldpath, char *newpath);
 int rd_readdir (int fd, char *buffer);
+int rd_readdir_many (int fd, char *buffer, int len, long long *cookie);
+int rd_readdir_range (int fd, dir_range_t *range, char *buffer, int len);
+int rd_readdir_prefix (int fd, char *prefix, char *cursor, char *buffer, int len);
+int rd_statfs (fs_stat_t *stat);
+int rd_release_memory (fs_stat_t *stat);
 
 
 extern int g_fd;
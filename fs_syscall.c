@@ -5,8 +5,10 @@
 #ifndef _KERNEL_MODE
 	#include <sys/types.h>
 	#include <unistd.h>
+	#include <string.h>
 #else
 	#include <linux/stddef.h>
+	#include <linux/string.h>
 	#include <linux/sched.h>
 	#include <linux/module.h>         /* Needed for the macros */
 	MODULE_LICENSE("GPL");
@@ -58,6 +60,10 @@ int sys_open (char *pathname) {
 	g_file_table[index][fd].inode = inode;
 	g_file_table[index][fd].offset = 0;
 
+	// a listing may go on from here, its slots must not move
+	if (inode_isdir (g_fs->super_block, inode))
+		inode_open_dir (g_fs->super_block, inode);
+
 	return fd;
 }
 
@@ -67,12 +73,16 @@ int sys_close (int fd) {
 	if (status < 0)
 		return -1;
 
+	int inode = g_file_table[status][fd].inode;
+	if (inode_isdir (g_fs->super_block, inode))
+		inode_close_dir (g_fs->super_block, inode);
+
 	_table_release_fd (pid, fd);
 
 	return 0;
 }
 
-int sys_read (int fd, char *buffer, int len) {
+long long sys_read (int fd, char *buffer, long long len) {
 	int pid = getpid ();
 	int status = _table_loolup_fd (pid, fd);
 	if (status < 0)
@@ -80,18 +90,18 @@ int sys_read (int fd, char *buffer, int len) {
 
 	int index = _table_lookup_pid (pid);
 	int inode = g_file_table[index][fd].inode;
-	int offset = g_file_table[index][fd].offset;
+	long long offset = g_file_table[index][fd].offset;
 
-	status = fs_read (g_fs, inode, offset, buffer, len);
-	if (status < 0)
+	long long count = fs_read (g_fs, inode, offset, buffer, len);
+	if (count < 0)
 		return -1;
 
-	g_file_table[index][fd].offset += status;
+	g_file_table[index][fd].offset += count;
 
-	return status;
+	return count;
 }
 
-int sys_write (int fd, char *buffer, int len) {
+long long sys_write (int fd, char *buffer, long long len) {
 	int pid = getpid ();
 	int status = _table_loolup_fd (pid, fd);
 	if (status < 0)
@@ -99,19 +109,23 @@ int sys_write (int fd, char *buffer, int len) {
 
 	int index = _table_lookup_pid (pid);
 	int inode = g_file_table[index][fd].inode;
-	int offset = g_file_table[index][fd].offset;
+	long long offset = g_file_table[index][fd].offset;
 
-	status = fs_write (g_fs, inode, offset, buffer, len);
-	if (status < 0) {
+	// dentries are written by creat, mkdir and unlink only, the directory index follows them
+	if (inode_isdir (g_fs->super_block, inode))
+		return -1;
+
+	long long count = fs_write (g_fs, inode, offset, buffer, len);
+	if (count < 0) {
 		return -1;
 	}
 
-	g_file_table[index][fd].offset += status;
+	g_file_table[index][fd].offset += count;
 
-	return status;
+	return count;
 }
 
-int sys_lseek (int fd, int offset) {
+int sys_lseek (int fd, long long offset) {
 	int pid = getpid ();
 	int status = _table_loolup_fd (pid, fd);
 	if (status < 0)
@@ -119,9 +133,9 @@ int sys_lseek (int fd, int offset) {
 
 	int index = _table_lookup_pid (pid);
 	int inode = g_file_table[index][fd].inode;
-	void *location = loc_locate (&g_fs->super_block->inodes[inode].location, offset);
 
-	if (location == NULL)
+	// past the end is fine, a write there leaves a hole
+	if (offset < 0 || offset > inode_max_size (g_fs->super_block, inode))
 		return -1;
 	if (inode_isdir (g_fs->super_block, inode))
 		return -1;
@@ -150,8 +164,84 @@ int sys_unlink (char *pathname) {
 	return status;
 }
 
+int sys_rename (char *oldpath, char *newpath) {
+	int inode = inode_lookup_full (g_fs->super_block, oldpath);
+	if (inode < 0)
+		return -1;
+
+	// what newpath names goes, not while it is opened
+	int target = inode_lookup_full (g_fs->super_block, newpath);
+	if (target >= 0 && target != inode && _table_lookup_inode (getpid (), target) >= 0)
+		return -1;
+
+	int status = fs_rename (g_fs, oldpath, newpath);
+	return status;
+}
+
 int sys_readdir (int fd, char *buffer) {
-	return sys_read (fd, buffer, sizeof (dir_entry_t));
+	dir_entry_t dentry;
+	long long status;
+
+	// skip the tombstones of unlinked entries
+	do
+		status = sys_read (fd, (char *)&dentry, sizeof (dir_entry_t));
+	while (status == sizeof (dir_entry_t) && dentry.inode == INODE_ROOT_INDEX);
+
+	if (status > 0)
+		memcpy (buffer, &dentry, status);
+
+	return status;
+}
+
+// as many entries as fit in len bytes, from the slot in the cookie, 0 at the
+// end, -1 if not even one fits or the cookie is no slot. the cookie comes back
+// pointing past them and so does the offset of fd. no slot moves while fd is
+// open, so the cookie holds across unlinks
+long long sys_readdir_many (int fd, char *buffer, long long len, long long *cookie) {
+	int pid = getpid ();
+	int status = _table_loolup_fd (pid, fd);
+	if (status < 0)
+		return -1;
+
+	int index = _table_lookup_pid (pid);
+	int inode = g_file_table[index][fd].inode;
+	if (!inode_isdir (g_fs->super_block, inode) || *cookie < 0 || *cookie != (unsigned int)*cookie || len < (long long)sizeof (dir_entry_t))
+		return -1;
+
+	unsigned int slot = *cookie;
+	int count = inode_readdir (g_fs->super_block, inode, &slot, (dir_entry_t *)buffer, len / sizeof (dir_entry_t));
+
+	*cookie = slot;
+	g_file_table[index][fd].offset = (long long)slot * sizeof (dir_entry_t);
+
+	return count * sizeof (dir_entry_t);
+}
+
+// the entries of the directory at fd in range, in name order, as many as fit
+// in len bytes. 0 when there are no more, the cursor in range follows
+long long sys_readdir_range (int fd, dir_range_t *range, char *buffer, long long len) {
+	int pid = getpid ();
+	int status = _table_loolup_fd (pid, fd);
+	if (status < 0)
+		return -1;
+
+	int index = _table_lookup_pid (pid);
+	int inode = g_file_table[index][fd].inode;
+	if (!inode_isdir (g_fs->super_block, inode) || len < (long long)sizeof (dir_entry_t))
+		return -1;
+
+	int count = inode_scandir (g_fs->super_block, inode, range, (dir_entry_t *)buffer, len / sizeof (dir_entry_t));
+
+	return count * sizeof (dir_entry_t);
+}
+
+int sys_statfs (fs_stat_t *stat) {
+	return fs_stat (g_fs, stat);
+}
+
+// free memory goes back to the host now instead of after the next big unlink
+long long sys_release_memory () {
+	return fs_release_memory (g_fs);
 }
 
 
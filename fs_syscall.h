@@ -10,16 +10,21 @@ int sys_creat (char *pathname);
 int sys_mkdir (char *pathname);
 int sys_open (char *pathname);
 int sys_close (int fd);
-int sys_read (int fd, char *buffer, int len);
-int sys_write (int fd, char *buffer, int len);
-int sys_lseek (int fd, int offset);
+long long sys_read (int fd, char *buffer, long long len);
+long long sys_write (int fd, char *buffer, long long len);
+int sys_lseek (int fd, long long offset);
 int sys_unlink (char *pathname);
+int sys_rename (char *oldpath, char *newpath);
 int sys_readdir (int fd, char *buffer);
+long long sys_readdir_many (int fd, char *buffer, long long len, long long *cookie);
+long long sys_readdir_range (int fd, dir_range_t *range, char *buffer, long long len);
+int sys_statfs (fs_stat_t *stat);
+long long sys_release_memory ();
 
 typedef struct file_t {
 	int inode;
 	int pid;
-	int offset;
+	long long offset;
 } file_t;
 
 
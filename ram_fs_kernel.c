@@ -1,3 +1,5 @@
+#define _KERNEL_MODE
+
 #include <linux/module.h>       /* Needed by all modules */
 #include <linux/kernel.h>       /* Needed for KERN_INFO */
 #include <linux/init.h>         /* Needed for the macros */
@@ -10,12 +12,25 @@
 
 MODULE_LICENSE("GPL");
 
+// geometry, 0 keeps the default from config.h, except for block_size
+static unsigned int disk_size_in_kb = 0;
+static unsigned int block_size = BLOCK_SIZE_IN_B;
+static unsigned int nr_of_inodes = 0;
+
+module_param (disk_size_in_kb, uint, 0444);
+MODULE_PARM_DESC (disk_size_in_kb, "RAM disk size in KB");
+module_param (block_size, uint, 0444);
+MODULE_PARM_DESC (block_size, "block size in bytes, a power of two, 0 for the page size");
+module_param (nr_of_inodes, uint, 0444);
+MODULE_PARM_DESC (nr_of_inodes, "number of index nodes");
+
 typedef struct command_t {
 	int 	fd;
 	char 	*pathname;
 	char 	*buffer;
 	int 	len;
 	int 	*status;
+	long long	offset;
 } command_t;
 
 #define MAGIC 'k'
@@ -29,6 +44,11 @@ typedef struct command_t {
 #define IOC_UNLINK	_IOWR (MAGIC, 6, command_t)
 #define IOC_READDIR _IOWR (MAGIC, 7, command_t)
 #define IOC_LSEEK	_IOWR (MAGIC, 8, command_t)
+#define IOC_STATFS	_IOWR (MAGIC, 9, command_t)
+#define IOC_RELEASE	_IOWR (MAGIC, 10, command_t)
+#define IOC_READDIR_MANY	_IOWR (MAGIC, 11, command_t)
+#define IOC_READDIR_RANGE	_IOWR (MAGIC, 12, command_t)
+#define IOC_RENAME	_IOWR (MAGIC, 13, command_t)
 
 static long proc_ioctl (struct file *file, unsigned int cmd, unsigned long arg);
 static struct file_operations proc_ops;
@@ -47,7 +67,15 @@ void printk_tty (char *string) {
 static int __init initialization_routine(void) {
 	printk ("Loading RAM Disk.\n");
 
-	g_fs = init_fs ();
+	geometry_t geometry;
+	geometry_default (&geometry);
+	if (disk_size_in_kb > 0)
+		geometry.disk_size_in_kb = disk_size_in_kb;
+	geometry.block_size = block_size;
+	if (nr_of_inodes > 0)
+		geometry.nr_of_inodes = nr_of_inodes;
+
+	g_fs = init_fs (&geometry);
 	memset (g_file_table, 0, sizeof (g_file_table));
 
 	if (g_fs == NULL) {
@@ -90,15 +118,24 @@ static void __exit cleanup_routine(void) {
 static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 	
 	command_t command;
-	char path[MAX_FILE_FULL];
+	char path[MAX_FILE_FULL + 1];
+	char new_path[MAX_FILE_FULL + 1];
 	void *buffer = NULL;
+	fs_stat_t stat;
+	dir_range_t range;
+	long long released;
 	int status;
 
 	switch (cmd){
 		case IOC_OPEN:
 			printk ("OPEN\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
-			memset (path, 0, MAX_FILE_FULL);
+			if (command.len < 0 || command.len > MAX_FILE_FULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (path, 0, sizeof (path));
 			copy_from_user (path, command.pathname, command.len);
 			status = sys_open (path);
 			printk ("%d:%s\n", status, path);
@@ -116,7 +153,12 @@ static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 		case IOC_CREAT:
 			printk ("CREAT\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
-			memset (path, 0, MAX_FILE_FULL);
+			if (command.len < 0 || command.len > MAX_FILE_FULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (path, 0, sizeof (path));
 			copy_from_user (path, command.pathname, command.len);
 			status = sys_creat (path);
 			printk ("%d:%s\n", status, path);
@@ -127,7 +169,12 @@ static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 		case IOC_MKDIR:
 			printk ("MKDIR\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
-			memset (path, 0, MAX_FILE_FULL);
+			if (command.len < 0 || command.len > MAX_FILE_FULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (path, 0, sizeof (path));
 			copy_from_user (path, command.pathname, command.len);
 			status = sys_mkdir (path);
 			printk ("%d:%s\n", status, path);
@@ -171,16 +218,21 @@ static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 		case IOC_LSEEK:
 			printk ("LSEEK\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
-			status = sys_lseek (command.fd, command.len);
+			status = sys_lseek (command.fd, command.offset);
 			copy_to_user (command.status, &status, sizeof (int));
-			printk ("%d:%d\n", status, command.len);
+			printk ("%d:%lld\n", status, command.offset);
 			return 0;
 
 
 		case IOC_UNLINK:
 			printk ("UNLINK\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
-			memset (path, 0, MAX_FILE_FULL);
+			if (command.len < 0 || command.len > MAX_FILE_FULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (path, 0, sizeof (path));
 			copy_from_user (path, command.pathname, command.len);
 			status = sys_unlink (path);
 			copy_to_user (command.status, &status, sizeof (int));
@@ -188,6 +240,24 @@ static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 			return 0;
 
 
+		case IOC_RENAME:
+			printk ("RENAME\n");
+			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
+			if (command.len < 0 || command.len > MAX_FILE_FULL || command.offset < 0 || command.offset > MAX_FILE_FULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (path, 0, sizeof (path));
+			memset (new_path, 0, sizeof (new_path));
+			copy_from_user (path, command.pathname, command.len);
+			copy_from_user (new_path, command.buffer, command.offset);
+			status = sys_rename (path, new_path);
+			copy_to_user (command.status, &status, sizeof (int));
+			printk ("%d:%s -> %s\n", status, path, new_path);
+			return 0;
+
+
 		case IOC_READDIR:
 			printk ("READDIR\n");
 			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
@@ -206,6 +276,80 @@ static long proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 			copy_to_user (command.status, &status, sizeof (int));
 			return 0;
 
+		case IOC_READDIR_MANY:
+			printk ("READDIR_MANY\n");
+			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
+			if (command.len < 0)
+				command.len = 0;
+			if (command.len > READDIR_MAX_ENTRIES * sizeof (dir_entry_t))
+				command.len = READDIR_MAX_ENTRIES * sizeof (dir_entry_t);
+			buffer = vmalloc (command.len);
+			if (buffer == NULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (buffer, 0, command.len);
+
+			// one crossing for the lot, the cookie goes back in the command
+			status = sys_readdir_many (command.fd, buffer, command.len, &command.offset);
+			if (status > 0)
+				copy_to_user (command.buffer, buffer, status);
+
+			vfree (buffer);
+			buffer = NULL;
+			printk ("%d:%lld\n", status, command.offset);
+			copy_to_user (&((command_t *)arg)->offset, &command.offset, sizeof (long long));
+			copy_to_user (command.status, &status, sizeof (int));
+			return 0;
+
+		case IOC_READDIR_RANGE:
+			printk ("READDIR_RANGE\n");
+			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
+			copy_from_user (&range, command.pathname, sizeof (dir_range_t));
+			if (command.len < 0)
+				command.len = 0;
+			if (command.len > READDIR_MAX_ENTRIES * sizeof (dir_entry_t))
+				command.len = READDIR_MAX_ENTRIES * sizeof (dir_entry_t);
+			buffer = vmalloc (command.len);
+			if (buffer == NULL) {
+				status = -1;
+				copy_to_user (command.status, &status, sizeof (int));
+				return 0;
+			}
+			memset (buffer, 0, command.len);
+
+			status = sys_readdir_range (command.fd, &range, buffer, command.len);
+			if (status > 0)
+				copy_to_user (command.buffer, buffer, status);
+
+			vfree (buffer);
+			buffer = NULL;
+			printk ("%d:%s\n", status, range.cursor);
+			copy_to_user (command.pathname, &range, sizeof (dir_range_t));
+			copy_to_user (command.status, &status, sizeof (int));
+			return 0;
+
+		case IOC_STATFS:
+			printk ("STATFS\n");
+			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
+			status = sys_statfs (&stat);
+			copy_to_user (command.buffer, &stat, sizeof (fs_stat_t));
+			copy_to_user (command.status, &status, sizeof (int));
+			printk ("%d:%llu/%llu, %u/%u chunks on huge pages\n", status, stat.resident, stat.capacity, stat.nr_of_huge_chunks, stat.nr_of_resident_chunks);
+			return 0;
+
+		case IOC_RELEASE:
+			printk ("RELEASE\n");
+			copy_from_user (&command, (command_t *)arg, sizeof (command_t));
+			released = sys_release_memory ();
+			status = sys_statfs (&stat);
+			if (command.buffer != NULL)
+				copy_to_user (command.buffer, &stat, sizeof (fs_stat_t));
+			copy_to_user (command.status, &status, sizeof (int));
+			printk ("%d:%lld\n", status, released);
+			return 0;
+
 		default:
 			return -EINVAL;
 	}
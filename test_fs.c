@@ -46,6 +46,18 @@
 #define TEST3
 #define TEST4
 #define TEST5
+#define TEST6
+#define TEST7
+#define TEST8
+#define TEST9
+#define TEST10
+#define TEST11
+#define TEST12
+#define TEST13
+#define TEST14
+#define TEST15
+#define TEST16
+#define TEST17
 
 // #define's to control whether single indirect or
 // double indirect block pointers are tested
@@ -59,6 +71,7 @@
 #define DIRECT 8		/* Direct pointers in location attribute */
 #define PTR_SZ 4		/* 32-bit [relative] addressing */
 #define PTRS_PB  (BLK_SZ / PTR_SZ) /* Pointers per index block */
+#define DENTRY_SZ 16	/* 13-byte name, 2-byte inode number */
 
 static char pathname[80];
 
@@ -77,10 +90,14 @@ static char addr[PTRS_PB*PTRS_PB*BLK_SZ+1]; /* Scratchpad memory */
 #define rd_write sys_write 
 #define rd_lseek sys_lseek 
 #define rd_unlink sys_unlink 
+#define rd_rename sys_rename
+#define rd_statfs sys_statfs
 #define rd_readdir sys_readdir
+#define rd_readdir_many sys_readdir_many
+#define rd_readdir_range sys_readdir_range
 #endif
 
-int main () {
+int main (int argc, char **argv) {
 	
 	int retval, i;
 	int fd;
@@ -92,7 +109,21 @@ int main () {
 	memset (data3, '3', sizeof (data3));
 
 #ifndef _KERNEL_MODE
-	g_fs = init_fs ();
+	// [disk_size_in_kb [block_size [nr_of_inodes]]], block_size 0 for the page size
+	geometry_t geometry;
+	geometry_default (&geometry);
+	if (argc > 1)
+		geometry.disk_size_in_kb = atoi (argv[1]);
+	if (argc > 2)
+		geometry.block_size = atoi (argv[2]);
+	if (argc > 3)
+		geometry.nr_of_inodes = atoi (argv[3]);
+
+	g_fs = init_fs (&geometry);
+	if (g_fs == NULL) {
+		fprintf (stderr, "init_fs: invalid geometry\n");
+		exit (1);
+	}
 #else
     g_fd = open ("/proc/ramdisk", O_RDWR);
 #endif
@@ -311,6 +342,1195 @@ int main () {
 
 	#endif // TEST4
 
+	#ifdef TEST6
+
+	/* ****TEST 6: Extent tree grows out of the inode**** */
+	/* Two files written a block at a time in turn, so neither gets
+	   physically contiguous blocks and every block is its own extent */
+	retval = rd_creat ("/ext1");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_creat: /ext1 creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	retval = rd_creat ("/ext2");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_creat: /ext2 creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	int fd1 = rd_open ("/ext1");
+	int fd2 = rd_open ("/ext2");
+
+	if (fd1 < 0 || fd2 < 0) {
+		fprintf (stderr, "rd_open: extent file open error! status: %d %d\n", fd1, fd2);
+		exit (1);
+	}
+
+	for (i = 0; i < PTRS_PB; i++) {
+		memset (addr, 'a' + i % 26, BLK_SZ);
+		retval = rd_write (fd1, addr, BLK_SZ);
+
+		if (retval != BLK_SZ) {
+			fprintf (stderr, "rd_write: /ext1 block %d error! status: %d\n", i, retval);
+			exit (1);
+		}
+
+		memset (addr, 'A' + i % 26, BLK_SZ);
+		retval = rd_write (fd2, addr, BLK_SZ);
+
+		if (retval != BLK_SZ) {
+			fprintf (stderr, "rd_write: /ext2 block %d error! status: %d\n", i, retval);
+			exit (1);
+		}
+	}
+
+#if !defined (_KERNEL_MODE) && defined (FS_EXTENT_MAPPING)
+	/* More extents than the inode holds, so the root must have split */
+	index_node_number = inode_lookup_full (g_fs->super_block, "/ext1");
+
+	if (g_fs->super_block->inodes[index_node_number].extents.header.depth == 0) {
+		fprintf (stderr, "extents: /ext1 root did not split\n");
+		exit (1);
+	}
+#endif
+
+	rd_lseek (fd1, 0);
+	rd_lseek (fd2, 0);
+
+	for (i = 0; i < PTRS_PB; i++) {
+		int j;
+		retval = rd_read (fd1, addr, BLK_SZ);
+
+		for (j = 0; j < BLK_SZ; j++)
+			if (retval != BLK_SZ || addr[j] != 'a' + i % 26) {
+				fprintf (stderr, "rd_read: /ext1 block %d wrong data! status: %d\n", i, retval);
+				exit (1);
+			}
+
+		retval = rd_read (fd2, addr, BLK_SZ);
+
+		for (j = 0; j < BLK_SZ; j++)
+			if (retval != BLK_SZ || addr[j] != 'A' + i % 26) {
+				fprintf (stderr, "rd_read: /ext2 block %d wrong data! status: %d\n", i, retval);
+				exit (1);
+			}
+	}
+
+	rd_close (fd1);
+	rd_close (fd2);
+
+	if (rd_unlink ("/ext1") < 0 || rd_unlink ("/ext2") < 0) {
+		fprintf (stderr, "rd_unlink: extent file deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST6
+
+	#ifdef TEST7
+
+	/* ****TEST 7: Inline data, out of the inode and back**** */
+	retval = rd_creat ("/small");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_creat: /small creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	fd = rd_open ("/small");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /small open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	/* 40 bytes fit in the inode, 100 do not */
+	for (i = 0; i < 100; i++)
+		data1[i] = 'a' + i % 26;
+
+	retval = rd_write (fd, data1, 40);
+
+	if (retval != 40) {
+		fprintf (stderr, "rd_write: /small inline write error! status: %d\n", retval);
+		exit (1);
+	}
+
+#if !defined (_KERNEL_MODE) && defined (FS_INLINE_DATA)
+	index_node_number = inode_lookup_full (g_fs->super_block, "/small");
+
+	if (!(g_fs->super_block->inodes[index_node_number].flags & INODE_FLAG_INLINE)) {
+		fprintf (stderr, "inline: /small not inline at 40 bytes\n");
+		exit (1);
+	}
+#endif
+
+	rd_lseek (fd, 0);
+	memset (addr, 0, 100);
+	retval = rd_read (fd, addr, 40);
+
+	if (retval != 40 || memcmp (addr, data1, 40) != 0) {
+		fprintf (stderr, "rd_read: /small inline data wrong! status: %d\n", retval);
+		exit (1);
+	}
+
+	retval = rd_write (fd, data1 + 40, 60);
+
+	if (retval != 60) {
+		fprintf (stderr, "rd_write: /small write past inline error! status: %d\n", retval);
+		exit (1);
+	}
+
+#if !defined (_KERNEL_MODE) && defined (FS_INLINE_DATA)
+	if (g_fs->super_block->inodes[index_node_number].flags & INODE_FLAG_INLINE) {
+		fprintf (stderr, "inline: /small still inline at 100 bytes\n");
+		exit (1);
+	}
+#endif
+
+	rd_lseek (fd, 0);
+	memset (addr, 0, 100);
+	retval = rd_read (fd, addr, 100);
+
+	if (retval != 100 || memcmp (addr, data1, 100) != 0) {
+		fprintf (stderr, "rd_read: /small data wrong after leaving the inode! status: %d\n", retval);
+		exit (1);
+	}
+
+#if !defined (_KERNEL_MODE) && defined (FS_INLINE_DATA)
+	/* Truncated to nothing it starts over in the inode */
+	inode_shrink (g_fs->super_block, index_node_number, 0);
+
+	if (!(g_fs->super_block->inodes[index_node_number].flags & INODE_FLAG_INLINE)) {
+		fprintf (stderr, "inline: /small not inline after truncation\n");
+		exit (1);
+	}
+
+	rd_lseek (fd, 0);
+	retval = rd_write (fd, data1 + 50, 20);
+	rd_lseek (fd, 0);
+	memset (addr, 0, 100);
+
+	if (retval != 20 || rd_read (fd, addr, 100) != 20 || memcmp (addr, data1 + 50, 20) != 0) {
+		fprintf (stderr, "rd_read: /small data wrong back in the inode!\n");
+		exit (1);
+	}
+#endif
+
+	memset (data1, '1', sizeof (data1));
+	rd_close (fd);
+
+	if (rd_unlink ("/small") < 0) {
+		fprintf (stderr, "rd_unlink: /small deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST7
+
+	#ifdef TEST8
+
+	/* ****TEST 8: Write past the end leaves a hole of zeros**** */
+	retval = rd_creat ("/sparse");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_creat: /sparse creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	fd = rd_open ("/sparse");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /sparse open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	retval = rd_write (fd, "head", 4);
+
+	if (retval != 4) {
+		fprintf (stderr, "rd_write: /sparse head error! status: %d\n", retval);
+		exit (1);
+	}
+
+	/* Well past the end, whole blocks in between are never written */
+	retval = rd_lseek (fd, 10 * BLK_SZ + 7);
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_lseek: /sparse seek past the end error! status: %d\n", retval);
+		exit (1);
+	}
+
+	retval = rd_write (fd, "tail", 4);
+
+	if (retval != 4) {
+		fprintf (stderr, "rd_write: /sparse tail error! status: %d\n", retval);
+		exit (1);
+	}
+
+	rd_lseek (fd, 0);
+	memset (addr, 0xff, 10 * BLK_SZ + 16);
+	retval = rd_read (fd, addr, 10 * BLK_SZ + 16);
+
+	if (retval != 10 * BLK_SZ + 11) {
+		fprintf (stderr, "rd_read: /sparse size wrong! status: %d\n", retval);
+		exit (1);
+	}
+
+	if (memcmp (addr, "head", 4) != 0 || memcmp (addr + 10 * BLK_SZ + 7, "tail", 4) != 0) {
+		fprintf (stderr, "rd_read: /sparse data wrong around the hole!\n");
+		exit (1);
+	}
+
+	for (i = 4; i < 10 * BLK_SZ + 7; i++)
+		if (addr[i] != 0) {
+			fprintf (stderr, "rd_read: /sparse hole not zero at %d!\n", i);
+			exit (1);
+		}
+
+	rd_close (fd);
+
+	if (rd_unlink ("/sparse") < 0) {
+		fprintf (stderr, "rd_unlink: /sparse deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST8
+
+	#ifdef TEST9
+
+	/* ****TEST 9: Unlinking leaves no gaps or repeats in a listing**** */
+	retval = rd_mkdir ("/dir9");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_mkdir: /dir9 creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	for (i = 0; i < 40; i++) {
+		sprintf (pathname, "/dir9/f%d", i);
+		retval = rd_creat (pathname);
+
+		if (retval < 0) {
+			fprintf (stderr, "rd_creat: %s creation error! status: %d\n", pathname, retval);
+			exit (1);
+		}
+	}
+
+	/* Early entries go, and new ones fill some of the holes they leave */
+	for (i = 0; i < 20; i += 2) {
+		sprintf (pathname, "/dir9/f%d", i);
+
+		if (rd_unlink (pathname) < 0) {
+			fprintf (stderr, "rd_unlink: %s deletion error!\n", pathname);
+			exit (1);
+		}
+	}
+
+	for (i = 0; i < 5; i++) {
+		sprintf (pathname, "/dir9/g%d", i);
+		retval = rd_creat (pathname);
+
+		if (retval < 0) {
+			fprintf (stderr, "rd_creat: %s creation error! status: %d\n", pathname, retval);
+			exit (1);
+		}
+	}
+
+	/* Then more holes than names, f30 to f39 and the g's are left */
+	for (i = 0; i < 30; i++) {
+		if (i < 20 && i % 2 == 0)
+			continue;
+		sprintf (pathname, "/dir9/f%d", i);
+
+		if (rd_unlink (pathname) < 0) {
+			fprintf (stderr, "rd_unlink: %s deletion error!\n", pathname);
+			exit (1);
+		}
+	}
+
+#ifndef _KERNEL_MODE
+	/* The holes were closed up along the way */
+	index_node_number = inode_lookup_full (g_fs->super_block, "/dir9");
+
+	if (g_fs->super_block->inodes[index_node_number].size > 2 * 15 * sizeof (dir_entry_t)) {
+		fprintf (stderr, "unlink: /dir9 never compacted, size %lld\n",
+			(long long)g_fs->super_block->inodes[index_node_number].size);
+		exit (1);
+	}
+#endif
+
+	fd = rd_open ("/dir9");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /dir9 open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	{
+		int seen[45];
+		memset (seen, 0, sizeof (seen));
+		memset (addr, 0, sizeof (addr));
+
+		while ((retval = rd_readdir (fd, addr))) {
+			if (retval < 0 || (addr[0] != 'f' && addr[0] != 'g')) {
+				fprintf (stderr, "rd_readdir: /dir9 read error! status: %d\n", retval);
+				exit (1);
+			}
+
+			seen[atoi (&addr[1]) + (addr[0] == 'g' ? 40 : 0)]++;
+		}
+
+		for (i = 0; i < 45; i++)
+			if (seen[i] != (i >= 30 ? 1 : 0)) {
+				fprintf (stderr, "rd_readdir: /dir9 %c%d listed %d times!\n",
+					i < 40 ? 'f' : 'g', i < 40 ? i : i - 40, seen[i]);
+				exit (1);
+			}
+	}
+
+	rd_close (fd);
+
+	/* Every name unlinked as it is listed, the way rm -r goes, with more
+	   names than the holes left so far */
+	for (i = 0; i < 20; i++) {
+		sprintf (pathname, "/dir9/h%d", i);
+		retval = rd_creat (pathname);
+
+		if (retval < 0) {
+			fprintf (stderr, "rd_creat: %s creation error! status: %d\n", pathname, retval);
+			exit (1);
+		}
+	}
+
+	fd = rd_open ("/dir9");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /dir9 open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	i = 0;
+	memset (addr, 0, sizeof (addr));
+
+	while ((retval = rd_readdir (fd, addr))) {
+		sprintf (pathname, "/dir9/%.13s", addr);
+
+		if (retval < 0 || rd_unlink (pathname) < 0) {
+			fprintf (stderr, "rd_unlink: %s deletion while listing error! status: %d\n", pathname, retval);
+			exit (1);
+		}
+
+		i++;
+	}
+
+	rd_close (fd);
+
+	if (i != 35) {
+		fprintf (stderr, "rd_readdir: /dir9 listed %d of 35 while unlinking!\n", i);
+		exit (1);
+	}
+
+	if (rd_unlink ("/dir9") < 0) {
+		fprintf (stderr, "rd_unlink: /dir9 deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST9
+
+	#ifdef TEST10
+
+	/* ****TEST 10: A batched listing resumes from its cookie across unlinks**** */
+	retval = rd_mkdir ("/dir10");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_mkdir: /dir10 creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	for (i = 0; i < 40; i++) {
+		sprintf (pathname, "/dir10/e%d", i);
+		retval = rd_creat (pathname);
+
+		if (retval < 0) {
+			fprintf (stderr, "rd_creat: %s creation error! status: %d\n", pathname, retval);
+			exit (1);
+		}
+	}
+
+	fd = rd_open ("/dir10");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /dir10 open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	{
+		int seen[40], j, k;
+		long long cookie = 1LL << 32;
+		memset (seen, 0, sizeof (seen));
+
+		/* A cookie no slot can have is refused */
+		retval = rd_readdir_many (fd, addr, 4 * DENTRY_SZ, &cookie);
+
+		if (retval >= 0) {
+			fprintf (stderr, "rd_readdir_many: /dir10 took a bad cookie! status: %d\n", retval);
+			exit (1);
+		}
+
+		/* One batch, then a name not listed yet goes too */
+		cookie = 0;
+		retval = rd_readdir_many (fd, addr, 5 * DENTRY_SZ, &cookie);
+
+		if (retval != 5 * DENTRY_SZ || rd_unlink ("/dir10/e12") < 0) {
+			fprintf (stderr, "rd_readdir_many: /dir10 first batch error! status: %d\n", retval);
+			exit (1);
+		}
+
+		/* Every batch is unlinked but for every tenth name before the next one
+		   is read, far more holes than names by the end */
+		do {
+			if (retval < 0 || retval % DENTRY_SZ != 0) {
+				fprintf (stderr, "rd_readdir_many: /dir10 read error! status: %d\n", retval);
+				exit (1);
+			}
+
+			for (j = 0; j < retval / DENTRY_SZ; j++) {
+				k = atoi (&addr[j * DENTRY_SZ + 1]);
+				seen[k]++;
+				sprintf (pathname, "/dir10/e%d", k);
+
+				if (k % 10 != 0 && rd_unlink (pathname) < 0) {
+					fprintf (stderr, "rd_unlink: %s deletion error!\n", pathname);
+					exit (1);
+				}
+			}
+		} while ((retval = rd_readdir_many (fd, addr, 4 * DENTRY_SZ, &cookie)));
+
+		for (i = 0; i < 40; i++)
+			if (seen[i] != (i == 12 ? 0 : 1)) {
+				fprintf (stderr, "rd_readdir_many: /dir10 e%d listed %d times!\n", i, seen[i]);
+				exit (1);
+			}
+	}
+
+	rd_close (fd);
+
+	for (i = 0; i < 40; i += 10) {
+		sprintf (pathname, "/dir10/e%d", i);
+
+		if (rd_unlink (pathname) < 0) {
+			fprintf (stderr, "rd_unlink: %s deletion error!\n", pathname);
+			exit (1);
+		}
+	}
+
+	if (rd_unlink ("/dir10") < 0) {
+		fprintf (stderr, "rd_unlink: /dir10 deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST10
+
+	#ifdef TEST11
+
+	/* ****TEST 11: Name ranges, prefixes and resuming from the cursor**** */
+	retval = rd_mkdir ("/dir11");
+
+	if (retval < 0) {
+		fprintf (stderr, "rd_mkdir: /dir11 creation error! status: %d\n", retval);
+		exit (1);
+	}
+
+	{
+		/* 0xff bytes sort last, a prefix ending in them has no simple upper bound */
+		static char *names[] = { "bz", "a", "abd", "x\xff\xff", "ab", "b", "\xff", "x\xfe", "ba", "y", "abc", "x\xff" };
+		static struct { char *from, *to; int prefix; char *expected; } cases[] = {
+			{ "ab", "b", 0, "ab,abc,abd," },
+			{ "", "abd", 0, "a,ab,abc," },
+			{ "b", "", 0, "b,ba,bz,x\xfe,x\xff,x\xff\xff,y,\xff," },
+			{ "abd", "abd", 0, "" },
+			{ "ab", "", 1, "ab,abc,abd," },
+			{ "x\xff", "", 1, "x\xff,x\xff\xff," },
+			{ "\xff", "", 1, "\xff," },
+			{ "c", "", 1, "" },
+		};
+		static struct { char *from, *to; int prefix; } scans[] = {
+			{ "n10", "n50", 0 },
+			{ "n2", "", 1 },
+			{ "", "", 0 },
+		};
+		int nr_of_names = sizeof (names) / sizeof (names[0]);
+		int nr_of_cases = sizeof (cases) / sizeof (cases[0]);
+		int nr_of_scans = sizeof (scans) / sizeof (scans[0]);
+		dir_range_t range;
+		char listing[128], expected[128];
+		int j, k;
+
+		for (i = 0; i < nr_of_names; i++) {
+			sprintf (pathname, "/dir11/%s", names[i]);
+			retval = rd_creat (pathname);
+
+			if (retval < 0) {
+				fprintf (stderr, "rd_creat: %s creation error! status: %d\n", pathname, retval);
+				exit (1);
+			}
+		}
+
+		fd = rd_open ("/dir11");
+
+		if (fd < 0) {
+			fprintf (stderr, "rd_open: /dir11 open error! status: %d\n", fd);
+			exit (1);
+		}
+
+		/* Two names a call, so every case resumes from its cursor */
+		for (k = 0; k < nr_of_cases; k++) {
+			memset (&range, 0, sizeof (range));
+			strcpy (range.from, cases[k].from);
+			strcpy (range.to, cases[k].to);
+			range.prefix = cases[k].prefix;
+			listing[0] = '\0';
+
+			while ((retval = rd_readdir_range (fd, &range, addr, 2 * DENTRY_SZ)) > 0)
+				for (j = 0; j < retval / DENTRY_SZ; j++) {
+					strcat (listing, &addr[j * DENTRY_SZ]);
+					strcat (listing, ",");
+				}
+
+			if (retval < 0 || strcmp (listing, cases[k].expected) != 0) {
+				fprintf (stderr, "rd_readdir_range: /dir11 case %d listed [%s]! status: %d\n", k, listing, retval);
+				exit (1);
+			}
+		}
+
+		/* The cursor is a name, it holds when that name goes mid-scan */
+		memset (&range, 0, sizeof (range));
+		listing[0] = '\0';
+
+		while ((retval = rd_readdir_range (fd, &range, addr, 3 * DENTRY_SZ)) > 0) {
+			for (j = 0; j < retval / DENTRY_SZ; j++) {
+				strcat (listing, &addr[j * DENTRY_SZ]);
+				strcat (listing, ",");
+			}
+
+			if (strcmp (range.cursor, "abc") == 0 && (rd_unlink ("/dir11/abc") < 0 || rd_unlink ("/dir11/b") < 0)) {
+				fprintf (stderr, "rd_unlink: /dir11 deletion error!\n");
+				exit (1);
+			}
+		}
+
+		if (retval < 0 || strcmp (listing, "a,ab,abc,abd,ba,bz,x\xfe,x\xff,x\xff\xff,y,\xff,") != 0) {
+			fprintf (stderr, "rd_readdir_range: /dir11 resumed listing [%s]! status: %d\n", listing, retval);
+			exit (1);
+		}
+
+		rd_close (fd);
+
+		for (i = 0; i < nr_of_names; i++) {
+			sprintf (pathname, "/dir11/%s", names[i]);
+			rd_unlink (pathname);
+		}
+
+		/* Three names in four go while the dir is closed, so it is compacted
+		   under the index, and the rest still list in order */
+		for (i = 0; i < 64; i++) {
+			sprintf (pathname, "/dir11/n%02d", i);
+			if (rd_creat (pathname) < 0) {
+				fprintf (stderr, "rd_creat: %s creation error!\n", pathname);
+				exit (1);
+			}
+		}
+
+		for (i = 0; i < 64; i++) {
+			sprintf (pathname, "/dir11/n%02d", i);
+			if (i % 4 != 0 && rd_unlink (pathname) < 0) {
+				fprintf (stderr, "rd_unlink: %s deletion error!\n", pathname);
+				exit (1);
+			}
+		}
+
+#ifndef _KERNEL_MODE
+		/* Every name is still at the slot the index has for it */
+		{
+			super_block_t *sb = g_fs->super_block;
+			int dir = inode_lookup_full (sb, "/dir11"), child;
+			dir_entry_t dentry;
+
+			if (sb->inodes[dir].size / sizeof (dir_entry_t) >= 64) {
+				fprintf (stderr, "inode_compact_dir: /dir11 still %lld slots long!\n", sb->inodes[dir].size / sizeof (dir_entry_t));
+				exit (1);
+			}
+
+			for (i = 0; i < 64; i += 4) {
+				sprintf (pathname, "/dir11/n%02d", i);
+				child = inode_lookup_full (sb, pathname);
+				if (child < 0 || inode_read (sb, dir, sb->dir_index.nodes[child].position * sizeof (dir_entry_t), &dentry, sizeof (dentry)) != sizeof (dentry) ||
+						strcmp ((char *)dentry.filename, pathname + 7) != 0 || dentry.inode != child) {
+					fprintf (stderr, "inode_compact_dir: %s lost its slot!\n", pathname);
+					exit (1);
+				}
+			}
+		}
+#endif
+
+		fd = rd_open ("/dir11");
+
+		if (fd < 0) {
+			fprintf (stderr, "rd_open: /dir11 open error! status: %d\n", fd);
+			exit (1);
+		}
+
+		for (k = 0; k < nr_of_scans; k++) {
+			memset (&range, 0, sizeof (range));
+			strcpy (range.from, scans[k].from);
+			strcpy (range.to, scans[k].to);
+			range.prefix = scans[k].prefix;
+			listing[0] = '\0';
+			expected[0] = '\0';
+
+			for (i = 0; i < 64; i += 4) {
+				sprintf (pathname, "n%02d", i);
+				if (scans[k].prefix ? strncmp (pathname, scans[k].from, strlen (scans[k].from)) == 0 :
+						strcmp (pathname, scans[k].from) >= 0 && (scans[k].to[0] == '\0' || strcmp (pathname, scans[k].to) < 0))
+					sprintf (expected + strlen (expected), "%s,", pathname);
+			}
+
+			while ((retval = rd_readdir_range (fd, &range, addr, 3 * DENTRY_SZ)) > 0)
+				for (j = 0; j < retval / DENTRY_SZ; j++) {
+					strcat (listing, &addr[j * DENTRY_SZ]);
+					strcat (listing, ",");
+				}
+
+			if (retval < 0 || strcmp (listing, expected) != 0) {
+				fprintf (stderr, "rd_readdir_range: /dir11 scan %d after unlinks listed [%s]! status: %d\n", k, listing, retval);
+				exit (1);
+			}
+		}
+
+		rd_close (fd);
+
+		for (i = 0; i < 64; i += 4) {
+			sprintf (pathname, "/dir11/n%02d", i);
+			rd_unlink (pathname);
+		}
+	}
+
+	if (rd_unlink ("/dir11") < 0) {
+		fprintf (stderr, "rd_unlink: /dir11 deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST11
+
+	#ifdef TEST12
+
+	/* ****TEST 12: Rename within a dir, across dirs and over a target**** */
+	if (rd_mkdir ("/ren") < 0 || rd_mkdir ("/ren/d1") < 0 || rd_mkdir ("/ren/d2") < 0 ||
+			rd_mkdir ("/ren/e") < 0 || rd_mkdir ("/ren/f") < 0) {
+		fprintf (stderr, "rd_mkdir: /ren directory creation error!\n");
+		exit (1);
+	}
+
+	if (rd_creat ("/ren/a") < 0 || rd_creat ("/ren/d2/old") < 0 || rd_creat ("/ren/f/x") < 0) {
+		fprintf (stderr, "rd_creat: /ren file creation error!\n");
+		exit (1);
+	}
+
+	fd = rd_open ("/ren/a");
+	retval = rd_write (fd, data2, sizeof (data2));
+
+	if (retval != sizeof (data2)) {
+		fprintf (stderr, "rd_write: /ren/a write error! status: %d\n", retval);
+		exit (1);
+	}
+
+	rd_close (fd);
+
+	/* Same dir, then across dirs, then over an existing file */
+	retval = rd_rename ("/ren/a", "/ren/b");
+
+	if (retval < 0 || rd_open ("/ren/a") >= 0) {
+		fprintf (stderr, "rd_rename: /ren/a to /ren/b error! status: %d\n", retval);
+		exit (1);
+	}
+
+	retval = rd_rename ("/ren/b", "/ren/d1/c");
+
+	if (retval < 0 || rd_open ("/ren/b") >= 0) {
+		fprintf (stderr, "rd_rename: /ren/b to /ren/d1/c error! status: %d\n", retval);
+		exit (1);
+	}
+
+	retval = rd_rename ("/ren/d1/c", "/ren/d2/old");
+
+	if (retval < 0 || rd_open ("/ren/d1/c") >= 0) {
+		fprintf (stderr, "rd_rename: /ren/d1/c over /ren/d2/old error! status: %d\n", retval);
+		exit (1);
+	}
+
+	/* The data came along under the last name */
+	fd = rd_open ("/ren/d2/old");
+
+	if (fd < 0) {
+		fprintf (stderr, "rd_open: /ren/d2/old open error! status: %d\n", fd);
+		exit (1);
+	}
+
+	memset (addr, 0, sizeof (data2));
+	retval = rd_read (fd, addr, sizeof (data2) + 1);
+
+	if (retval != sizeof (data2) || memcmp (addr, data2, sizeof (data2)) != 0) {
+		fprintf (stderr, "rd_read: /ren/d2/old wrong data after rename! status: %d\n", retval);
+		exit (1);
+	}
+
+	rd_close (fd);
+
+	/* An empty dir gives way to a dir, the one moved keeps its name inside */
+	retval = rd_rename ("/ren/d2", "/ren/e");
+
+	if (retval < 0 || rd_open ("/ren/d2") >= 0 || (fd = rd_open ("/ren/e/old")) < 0) {
+		fprintf (stderr, "rd_rename: /ren/d2 over /ren/e error! status: %d\n", retval);
+		exit (1);
+	}
+
+	rd_close (fd);
+
+	/* Refused: over a dir that is not empty, under itself, across kinds */
+	if (rd_rename ("/ren/e", "/ren/f") >= 0 || rd_rename ("/ren/e", "/ren/e/sub") >= 0 ||
+			rd_rename ("/ren", "/ren/d1/sub") >= 0 || rd_rename ("/ren/e/old", "/ren/d1") >= 0) {
+		fprintf (stderr, "rd_rename: /ren a bad rename went through!\n");
+		exit (1);
+	}
+
+	if ((fd = rd_open ("/ren/e/old")) < 0 || rd_close (fd) < 0 || (fd = rd_open ("/ren/f/x")) < 0) {
+		fprintf (stderr, "rd_rename: /ren a refused rename moved something!\n");
+		exit (1);
+	}
+
+	rd_close (fd);
+
+	if (rd_unlink ("/ren/e/old") < 0 || rd_unlink ("/ren/f/x") < 0 || rd_unlink ("/ren/e") < 0 ||
+			rd_unlink ("/ren/f") < 0 || rd_unlink ("/ren/d1") < 0 || rd_unlink ("/ren") < 0) {
+		fprintf (stderr, "rd_unlink: /ren deletion error!\n");
+		exit (1);
+	}
+
+	#endif // TEST12
+
+	#ifdef TEST13
+
+	/* ****TEST 13: A big unlink gives its blocks back in the background**** */
+	{
+		/* Earlier unlinks may still be reclaimed meanwhile, so what is in use
+		   with the file written is the mark to fall below */
+		fs_stat_t written, after;
+		long long size = sizeof (data3) + sizeof (data2);
+
+		if (rd_creat ("/reclaim") < 0 || (fd = rd_open ("/reclaim")) < 0) {
+			fprintf (stderr, "rd_creat: /reclaim creation error!\n");
+			exit (1);
+		}
+
+		/* Past the size unlink frees blocks right away */
+		retval = rd_write (fd, data3, sizeof (data3));
+		retval += rd_write (fd, data2, sizeof (data2));
+
+		if (retval != size || size <= RECLAIM_ASYNC_THRESHOLD_IN_KB * 1024) {
+			fprintf (stderr, "rd_write: /reclaim write error! status: %d\n", retval);
+			exit (1);
+		}
+
+		rd_close (fd);
+
+		if (rd_statfs (&written) < 0) {
+			fprintf (stderr, "rd_statfs: error with /reclaim written!\n");
+			exit (1);
+		}
+
+		if (rd_unlink ("/reclaim") < 0) {
+			fprintf (stderr, "rd_unlink: /reclaim deletion error!\n");
+			exit (1);
+		}
+
+		/* The worker may still be at it, give it up to five seconds */
+		for (i = 0; i < 500; i++) {
+			rd_statfs (&after);
+			if (after.in_use + size <= written.in_use)
+				break;
+			usleep (10000);
+		}
+
+		if (after.in_use + size > written.in_use) {
+			fprintf (stderr, "rd_unlink: /reclaim blocks never came back, %llu bytes in use against %llu!\n",
+				after.in_use, written.in_use);
+			exit (1);
+		}
+	}
+
+	#endif // TEST13
+
+	#ifdef TEST14
+
+	/* ****TEST 14: A sparse file past the double-indirect limit**** */
+	{
+		/* Location objects map what lies past direct, single and double
+		   indirect blocks through the triple-indirect one */
+#ifndef _KERNEL_MODE
+		long long triple = g_fs->super_block->geometry.limit_double_indirect;
+		long long subtree = g_fs->super_block->geometry.size_3_level;
+#else
+		long long triple = sizeof (data1) + sizeof (data2) + sizeof (data3);
+		long long subtree = sizeof (data3);
+#endif
+		/* Across the double to triple boundary, further in the first
+		   subtree, and three subtrees down */
+		long long offsets[3] = { triple - BLK_SZ / 2, triple + 5 * BLK_SZ, triple + 3 * subtree + 7 };
+		char pattern[BLK_SZ];
+		fs_stat_t created, after;
+
+		if (rd_creat ("/triple") < 0 || (fd = rd_open ("/triple")) < 0) {
+			fprintf (stderr, "rd_creat: /triple creation error!\n");
+			exit (1);
+		}
+
+		if (rd_statfs (&created) < 0) {
+			fprintf (stderr, "rd_statfs: error with /triple created!\n");
+			exit (1);
+		}
+
+		for (i = 0; i < 3; i++) {
+			memset (pattern, 'a' + i, sizeof (pattern));
+			if (rd_lseek (fd, offsets[i]) < 0 || (retval = rd_write (fd, pattern, sizeof (pattern))) != sizeof (pattern)) {
+				fprintf (stderr, "rd_write: /triple write error at %lld! status: %d\n", offsets[i], retval);
+				exit (1);
+			}
+		}
+
+		for (i = 0; i < 3; i++) {
+			memset (pattern, 'a' + i, sizeof (pattern));
+			if (rd_lseek (fd, offsets[i]) < 0 || rd_read (fd, addr, sizeof (pattern)) != sizeof (pattern) ||
+					memcmp (addr, pattern, sizeof (pattern)) != 0) {
+				fprintf (stderr, "rd_read: /triple read back error at %lld!\n", offsets[i]);
+				exit (1);
+			}
+		}
+
+		/* The holes in between read as zeros, below and past the boundary */
+		memset (pattern, 0, sizeof (pattern));
+		if (rd_lseek (fd, sizeof (data1)) < 0 || rd_read (fd, addr, sizeof (pattern)) != sizeof (pattern) ||
+				memcmp (addr, pattern, sizeof (pattern)) != 0 ||
+				rd_lseek (fd, triple + 2 * BLK_SZ) < 0 || rd_read (fd, addr, sizeof (pattern)) != sizeof (pattern) ||
+				memcmp (addr, pattern, sizeof (pattern)) != 0) {
+			fprintf (stderr, "rd_read: /triple hole is not zero!\n");
+			exit (1);
+		}
+
+		rd_close (fd);
+
+#ifndef _KERNEL_MODE
+		/* Cut to nothing, every data and index block comes back at once */
+		inode_shrink (g_fs->super_block, inode_lookup_full (g_fs->super_block, "/triple"), 0);
+		rd_statfs (&after);
+		if (after.in_use > created.in_use) {
+			fprintf (stderr, "inode_shrink: /triple kept blocks, %llu bytes in use against %llu!\n",
+				after.in_use, created.in_use);
+			exit (1);
+		}
+#endif
+
+		if (rd_unlink ("/triple") < 0) {
+			fprintf (stderr, "rd_unlink: /triple deletion error!\n");
+			exit (1);
+		}
+
+		/* Past the reclaim threshold the worker may have it, wait as above */
+		for (i = 0; i < 500; i++) {
+			rd_statfs (&after);
+			if (after.in_use <= created.in_use)
+				break;
+			usleep (10000);
+		}
+
+		if (after.in_use > created.in_use) {
+			fprintf (stderr, "rd_unlink: /triple blocks never came back, %llu bytes in use against %llu!\n",
+				after.in_use, created.in_use);
+			exit (1);
+		}
+	}
+
+	#endif // TEST14
+
+	#ifdef TEST15
+
+	/* ****TEST 15: Cached lookups follow creates, unlinks and renames**** */
+	{
+#if !defined (_KERNEL_MODE) && defined (FS_DENTRY_CACHE)
+		super_block_t *sb = g_fs->super_block;
+		int cached, reused;
+#endif
+
+		if (rd_mkdir ("/dc") < 0 || rd_mkdir ("/dc/a") < 0 || rd_creat ("/dc/a/x") < 0) {
+			fprintf (stderr, "rd_mkdir: /dc creation error!\n");
+			exit (1);
+		}
+
+		/* A miss, then the name comes in */
+		if ((fd = rd_open ("/dc/f")) >= 0) {
+			fprintf (stderr, "rd_open: /dc/f opened before it was created!\n");
+			exit (1);
+		}
+
+#if !defined (_KERNEL_MODE) && defined (FS_DENTRY_CACHE)
+		if (!dentry_cache_lookup (sb, "/dc/f", 0, &cached) || cached != -1) {
+			fprintf (stderr, "dentry_cache_lookup: /dc/f miss not cached!\n");
+			exit (1);
+		}
+#endif
+
+		if (rd_creat ("/dc/f") < 0 || (fd = rd_open ("/dc/f")) < 0) {
+			fprintf (stderr, "rd_open: /dc/f not found after a cached miss!\n");
+			exit (1);
+		}
+
+		rd_close (fd);
+
+		/* A hit, then the name goes */
+#if !defined (_KERNEL_MODE) && defined (FS_DENTRY_CACHE)
+		if (!dentry_cache_lookup (sb, "/dc/f", 0, &cached) || cached < 0) {
+			fprintf (stderr, "dentry_cache_lookup: /dc/f hit not cached!\n");
+			exit (1);
+		}
+#endif
+
+		if (rd_unlink ("/dc/f") < 0 || (fd = rd_open ("/dc/f")) >= 0) {
+			fprintf (stderr, "rd_open: /dc/f found after a cached hit was unlinked!\n");
+			exit (1);
+		}
+
+		/* Every path below a dir that moves, misses included */
+		if ((fd = rd_open ("/dc/a/x")) < 0 || rd_close (fd) < 0 || (fd = rd_open ("/dc/b/x")) >= 0) {
+			fprintf (stderr, "rd_open: /dc/a/x lookup error before the rename!\n");
+			exit (1);
+		}
+
+		if (rd_rename ("/dc/a", "/dc/b") < 0) {
+			fprintf (stderr, "rd_rename: /dc/a to /dc/b error!\n");
+			exit (1);
+		}
+
+		if ((fd = rd_open ("/dc/a/x")) >= 0 || (fd = rd_open ("/dc/b/x")) < 0) {
+			fprintf (stderr, "rd_open: /dc/a/x lookup error after the rename!\n");
+			exit (1);
+		}
+
+		rd_close (fd);
+
+		/* A freed inode number taken by the same name in another dir */
+#if !defined (_KERNEL_MODE) && defined (FS_DENTRY_CACHE)
+		if (!dentry_cache_lookup (sb, "/dc/b/x", 0, &cached) || cached < 0) {
+			fprintf (stderr, "dentry_cache_lookup: /dc/b/x hit not cached!\n");
+			exit (1);
+		}
+#endif
+
+		if (rd_unlink ("/dc/b/x") < 0 || rd_creat ("/dc/x") < 0) {
+			fprintf (stderr, "rd_unlink: /dc/b/x to /dc/x error!\n");
+			exit (1);
+		}
+
+#if !defined (_KERNEL_MODE) && defined (FS_DENTRY_CACHE)
+		reused = inode_lookup_full (sb, "/dc/x");
+		if (reused != cached) {
+			fprintf (stderr, "inode_allocate: /dc/x got %d, not the freed %d!\n", reused, cached);
+			exit (1);
+		}
+#endif
+
+		if ((fd = rd_open ("/dc/b/x")) >= 0) {
+			fprintf (stderr, "rd_open: /dc/b/x found through a reused inode!\n");
+			exit (1);
+		}
+
+		if (rd_unlink ("/dc/x") < 0 || rd_unlink ("/dc/b") < 0 || rd_unlink ("/dc") < 0) {
+			fprintf (stderr, "rd_unlink: /dc deletion error!\n");
+			exit (1);
+		}
+	}
+
+	#endif // TEST15
+
+	#ifdef TEST16
+
+	/* ****TEST 16: Statfs follows a file, release hands its memory back**** */
+	{
+		fs_stat_t before, written, unlinked, released;
+		long long size = 4 * sizeof (data2);
+#ifndef _KERNEL_MODE
+		long long bytes;
+#endif
+
+		if (rd_statfs (&before) < 0 || before.free_inodes == 0 || before.free_inodes >= before.nr_of_inodes ||
+				before.in_use > before.capacity) {
+			fprintf (stderr, "rd_statfs: bad counts before /stat!\n");
+			exit (1);
+		}
+
+		if (rd_creat ("/stat") < 0 || (fd = rd_open ("/stat")) < 0) {
+			fprintf (stderr, "rd_creat: /stat creation error!\n");
+			exit (1);
+		}
+
+		/* Below the reclaim threshold, the blocks go at unlink */
+		if ((retval = rd_write (fd, data3, size)) != size) {
+			fprintf (stderr, "rd_write: /stat write error! status: %d\n", retval);
+			exit (1);
+		}
+
+		rd_close (fd);
+
+		if (rd_statfs (&written) < 0 || written.free_inodes != before.free_inodes - 1 ||
+				written.in_use < before.in_use + size) {
+			fprintf (stderr, "rd_statfs: /stat not counted, %u inodes and %llu bytes in use against %u and %llu!\n",
+				written.free_inodes, written.in_use, before.free_inodes, before.in_use);
+			exit (1);
+		}
+
+		if (rd_unlink ("/stat") < 0) {
+			fprintf (stderr, "rd_unlink: /stat deletion error!\n");
+			exit (1);
+		}
+
+		if (rd_statfs (&unlinked) < 0 || unlinked.free_inodes != before.free_inodes || unlinked.in_use > before.in_use) {
+			fprintf (stderr, "rd_statfs: /stat still counted, %u inodes and %llu bytes in use against %u and %llu!\n",
+				unlinked.free_inodes, unlinked.in_use, before.free_inodes, before.in_use);
+			exit (1);
+		}
+
+		/* Whole free pages, or chunks in the kernel, leave what is resident */
+#ifndef _KERNEL_MODE
+		bytes = sys_release_memory ();
+		retval = rd_statfs (&released);
+		if (retval < 0 || bytes <= 0 || released.resident + bytes > unlinked.resident) {
+			fprintf (stderr, "sys_release_memory: released %lld, resident %llu against %llu!\n",
+				bytes, released.resident, unlinked.resident);
+			exit (1);
+		}
+#else
+		retval = rd_release_memory (&released);
+		if (retval < 0 || released.resident > unlinked.resident) {
+			fprintf (stderr, "rd_release_memory: resident %llu against %llu! status: %d\n",
+				released.resident, unlinked.resident, retval);
+			exit (1);
+		}
+#endif
+
+		if (released.in_use != unlinked.in_use || released.free_inodes != unlinked.free_inodes) {
+			fprintf (stderr, "rd_release_memory: counts changed, %llu bytes in use against %llu!\n",
+				released.in_use, unlinked.in_use);
+			exit (1);
+		}
+	}
+
+	#endif // TEST16
+
+	#ifdef TEST17
+
+	/* ****TEST 17: A disk filled, emptied and released takes data again**** */
+	{
+		fs_stat_t before, full, after;
+		long long size = sizeof (data3), total = 0, done, len;
+		char back[4096];
+		long long piece = sizeof (back);
+
+		for (done = 0; done < size; done++)
+			addr[done] = done % 251;
+
+		if (rd_statfs (&before) < 0 || rd_creat ("/fill") < 0 || (fd = rd_open ("/fill")) < 0) {
+			fprintf (stderr, "rd_creat: /fill creation error!\n");
+			exit (1);
+		}
+
+		/* Until a write comes up short, the device has no block left */
+		do {
+			retval = rd_write (fd, addr, size);
+			total += retval > 0 ? retval : 0;
+		} while (retval == size);
+
+		rd_close (fd);
+
+		if (rd_statfs (&full) < 0 || total == 0 || full.in_use <= before.in_use) {
+			fprintf (stderr, "rd_write: /fill wrote %lld bytes!\n", total);
+			exit (1);
+		}
+
+		if (rd_unlink ("/fill") < 0) {
+			fprintf (stderr, "rd_unlink: /fill deletion error!\n");
+			exit (1);
+		}
+
+		for (i = 0; i < 500; i++) {
+			rd_statfs (&after);
+			if (after.in_use <= before.in_use)
+				break;
+			usleep (10000);
+		}
+
+		/* Chunks with no block in use go back to the host, and in user
+		   mode the free pages of the others. past the release threshold
+		   the reclaimer may have let them go already */
+#ifndef _KERNEL_MODE
+		retval = sys_release_memory () < 0 ? -1 : rd_statfs (&after);
+		if (retval < 0 || after.resident >= full.resident) {
+#else
+		retval = rd_release_memory (&after);
+		if (retval < 0 || after.resident > full.resident) {
+#endif
+			fprintf (stderr, "rd_release_memory: /fill %llu bytes resident against %llu! status: %d\n",
+				after.resident, full.resident, retval);
+			exit (1);
+		}
+
+		/* As much again, on chunks taken anew */
+		if (rd_creat ("/fill") < 0 || (fd = rd_open ("/fill")) < 0) {
+			fprintf (stderr, "rd_creat: /fill creation error after the release!\n");
+			exit (1);
+		}
+
+		for (done = 0; done < total; done += len) {
+			len = total - done < size ? total - done : size;
+			if ((retval = rd_write (fd, addr, len)) != len) {
+				fprintf (stderr, "rd_write: /fill write error after the release at %lld! status: %d\n", done, retval);
+				exit (1);
+			}
+		}
+
+		rd_lseek (fd, 0);
+		for (done = 0; done < total; done += len) {
+			len = total - done < piece ? total - done : piece;
+			if (rd_read (fd, back, len) != len || memcmp (back, addr + done % size, len) != 0) {
+				fprintf (stderr, "rd_read: /fill read back error after the release at %lld!\n", done);
+				exit (1);
+			}
+		}
+
+		rd_close (fd);
+
+		if (rd_unlink ("/fill") < 0) {
+			fprintf (stderr, "rd_unlink: /fill deletion error!\n");
+			exit (1);
+		}
+
+		for (i = 0; i < 500; i++) {
+			rd_statfs (&after);
+			if (after.in_use <= before.in_use)
+				break;
+			usleep (10000);
+		}
+	}
+
+	#endif // TEST17
+
 	#ifdef TEST5
 
 	/* ****TEST 5: 2 process test**** */